@@ -26,6 +26,8 @@
 //
 
 #include "bitblt.h"
+#include <algorithm>
+#include <cstdlib>
 
 /* "source"
  "initialize a table of bit masks ... p.356"
@@ -204,6 +206,96 @@ bool BitBlt::copyBits() {
 	return true;
 }
 
+bool BitBlt::drawLoopX_Y(int xDelta, int yDelta) {
+	/* "source"
+		"from drawLoopX:Y:, p.364 (Bresenham's algorithm)"
+		dx <- xDelta sign.
+		dy <- yDelta sign.
+		px <- yDelta abs.
+		py <- xDelta abs.
+		self copyBits.
+		py > px
+			ifTrue: "more horizontal"
+				[P <- py // 2.
+				1 to: py do:
+					[ :i |
+						destX <- destX + dx.
+						(P <- P - px) < 0
+							ifTrue: [destY <- destY + dy.
+								P <- P + py].
+						self copyBits]]
+			ifFalse: "more vertical"
+				[P <- px // 2.
+				1 to: px do:
+					[ :i |
+						destY <- destY + dy.
+						(P <- P - py) < 0
+							ifTrue: [destX <- destX + dx.
+								P <- P + px].
+						self copyBits]]
+	*/
+	
+	// dx and dy are taken by copyBits, so the steps have other names
+	int xStep = (xDelta > 0) - (xDelta < 0);
+	int yStep = (yDelta > 0) - (yDelta < 0);
+	int px = std::abs(yDelta);
+	int py = std::abs(xDelta);
+	int boundsLeft = 0, boundsTop = 0, boundsRight = 0, boundsBottom = 0;
+	bool drawn = false;
+	
+	// Each stamp replaces the updated bounds, so they are gathered as it goes
+	auto stamp = [&]() {
+		if (!copyBits())
+			return false;
+		if (updatedWidth > 0 && updatedHeight > 0) {
+			if (!drawn) {
+				boundsLeft = updatedX;
+				boundsTop = updatedY;
+				boundsRight = updatedX + updatedWidth;
+				boundsBottom = updatedY + updatedHeight;
+				drawn = true;
+			} else {
+				boundsLeft = std::min(boundsLeft, updatedX);
+				boundsTop = std::min(boundsTop, updatedY);
+				boundsRight = std::max(boundsRight, updatedX + updatedWidth);
+				boundsBottom = std::max(boundsBottom, updatedY + updatedHeight);
+			}
+		}
+		return true;
+	};
+	
+	bool succeeded = stamp();
+	if (py > px) {
+		// more horizontal
+		int p = py / 2;
+		for (int i = 1; succeeded && i <= py; i++) {
+			destX = destX + xStep;
+			if ((p = p - px) < 0) {
+				destY = destY + yStep;
+				p = p + py;
+			}
+			succeeded = stamp();
+		}
+	} else {
+		// more vertical
+		int p = px / 2;
+		for (int i = 1; succeeded && i <= px; i++) {
+			destY = destY + yStep;
+			if ((p = p - py) < 0) {
+				destX = destX + xStep;
+				p = p + px;
+			}
+			succeeded = stamp();
+		}
+	}
+	
+	updatedX = boundsLeft;
+	updatedY = boundsTop;
+	updatedWidth = boundsRight - boundsLeft;
+	updatedHeight = boundsBottom - boundsTop;
+	return succeeded;
+}
+
 void BitBlt::copyLoop() {
 	
 	std::uint16_t prevWord;
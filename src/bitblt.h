@@ -109,6 +109,16 @@ public:
 
     bool copyBits();
 
+    // drawLoopX:Y: -- stamps the source along a line with copyBits, leaving destX and destY at
+    // its end and the updated bounds covering every stamp
+    bool drawLoopX_Y(int xDelta, int yDelta);
+
+    void getDestination(int *x, int *y)
+    {
+        *x = destX;
+        *y = destY;
+    }
+
     void getUpdatedBounds(int *boundsX, int *boundsY, int *boundsWidth, int *boundsHeight)
     {
         *boundsX = updatedX;
@@ -24,6 +24,12 @@
 // implement optional primitiveScanCharacters
 #define IMPLEMENT_PRIMITIVE_SCANCHARS
 
+// implement optional primitiveStringReplace
+#define IMPLEMENT_PRIMITIVE_STRING_REPLACE
+
+// implement optional primitiveDrawLoop
+#define IMPLEMENT_PRIMITIVE_DRAW_LOOP
+
 
 // The Smalltalk-80 VM generates a tremendous amount of circular references as it runs
 //  -- primarily a MethodContext that references a BlockContext (from a temp field) that
@@ -50,6 +56,120 @@
 
 //#define RECURSIVE_MARKING
 
+// Define to mark accessible objects on several threads during a full garbage collection.
+// The marker uses a mark bitmap and work-stealing mark stacks rather than the count field
+// and pointer reversal, so it only applies to mark and sweep (GC_MARK_SWEEP) collections.
+// Reference counting still uses the algorithm selected above.
+
+//#define PARALLEL_MARKING
+
+// Number of threads used by PARALLEL_MARKING. Zero means one per hardware thread. With just
+// one thread the sequential marker is used instead.
+#define PARALLEL_MARKING_THREADS 0
+
+// Define to mark accessible objects during a full garbage collection with a mark bitmap and
+// an explicit mark stack instead of the count field and pointer reversal, so objects are only
+// read while marking. Marked objects whose fields do not fit on the stack are found again
+// by rescanning the bitmap. An alternative to PARALLEL_MARKING; requires GC_MARK_SWEEP.
+
+//#define BITMAP_MARKING
+
+// Define to allocate objects smaller than BigSize words from a region kept for each size in
+// each heap segment once no freed chunk of that size is left. Consecutive allocations of one
+// size are then next to each other rather than split off the end of the biggest free chunk.
+
+#define SIZE_CLASS_REGIONS
+
+// Define to keep an index of the instances of each class for primitiveSomeInstance and
+// primitiveNextInstance, rather than scanning the object table for every instance. The
+// index is built the first time it is needed and dropped by each full garbage collection.
+
+#define INSTANCE_INDEX
+
+// Define to keep a bitmap of the object table entries that are in use, and the highest entry
+// used, so that scans of the object table (garbage collection, instance enumeration, counting
+// free oops and saving a snapshot) skip the free entries rather than visiting all of them.
+
+#define OBJECT_TABLE_BITMAP
+
+// Define to keep the address of each object's chunk in a table beside the object table, so
+// that fields are reached without decoding the segment and location words of the entry. The
+// object table itself keeps the image's layout and remains the one that is loaded and saved.
+
+#define OBJECT_ADDRESS_TABLE
+
+// Define to clear the free space left at the top of each heap segment by loading and by
+// compaction, and to keep track of how much of it is still clear. New objects without
+// pointers allocated from that space are then not filled with zeros a second time.
+
+#define ZEROED_FREE_SPACE
+
+// Define to count the objects and words allocated for each class, and to record where every
+// ALLOCATION_SAMPLE_INTERVAL'th allocation was made (the method, instruction pointer and
+// receiver class). The report is written by primitive 136 and when the virtual machine exits.
+
+//#define ALLOCATION_PROFILING
+
+#define ALLOCATION_SAMPLE_INTERVAL 97
+
+// Define to keep statistics on garbage collection: why and how often full collections run,
+// their pauses, what they reclaim, the fragmentation they leave, and the lengths of reference
+// count cascades. Available from primitive 137 and logged by the -gclog option.
+
+//#define GC_STATISTICS
+
+// Define to copy the objects of an interchange format image into the heap segments, and clear
+// their free space, on a thread per hardware thread (up to one per segment) when it is loaded.
+
+//#define PARALLEL_LOADING
+
+// Define to support native images, which hold real_memory exactly as it is laid out so that
+// loading one is a matter of mapping the file (or reading it in one go) rather than relocating
+// every object. The -native option writes snapshots in this format.
+
+//#define NATIVE_IMAGES
+
+// Define to support compressed images, which are interchange format images packed a block at
+// a time with a small LZ77. The -compress option writes snapshots this way, each block being
+// packed on a thread of its own while the next is gathered.
+
+//#define COMPRESSED_SNAPSHOTS
+
+// Define to support delta snapshots, which append the pages of object memory that have changed
+// to a file beside the native image they apply to. The -delta option writes snapshots this way.
+// Requires NATIVE_IMAGES.
+
+//#define DELTA_SNAPSHOTS
+
+// Define to write a checksum of every 64KB with snapshots, and to check them (on several
+// threads) when an image that has them is loaded. Only the tables of a native image that has
+// been mapped are checked, since checking its object memory reads every page of the file
+// at once.
+
+#define SNAPSHOT_CHECKSUMS
+
+// Define to check the object memory of mapped native images as well, giving up the lazy
+// loading that mapping provides. Requires SNAPSHOT_CHECKSUMS.
+
+//#define CHECK_MAPPED_IMAGES
+
+// Define to load interchange format images written on a host of the other byte order, such as
+// the original big endian Xerox images, by swapping them as they are loaded with the same rules
+// as misc/imageswapper.c.
+
+#define BYTE_SWAPPED_IMAGES
+
+// Define to write snapshots from a child process made by fork() once the garbage has been
+// collected, while the virtual machine carries on running. Not available on Windows.
+
+//#define FORK_SNAPSHOTS
+
+// Compact the whole heap after a full garbage collection once this percentage of the free
+// words lies in chunks between objects rather than at the top of a segment. Zero disables
+// the check. The whole heap is also compacted when an allocation fails even though there
+// is enough free space in total, and by primitive 134.
+#define HEAP_COMPACTION_THRESHOLD 25
+
 // Perform range checks etc. at runtime
 //#define RUNTIME_CHECKING
 
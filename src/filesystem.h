@@ -54,11 +54,22 @@ public:
 	
 	virtual bool file_flush(int file_handle) = 0;
 	
+	// Map bytes of the file from offset over the page aligned address, privately so that
+	// changes to memory are not written back. Answers false if this is not supported.
+	virtual bool map_file(int /* file_handle */, int /* offset */, void * /* address */, int /* bytes */) {
+		return false;
+	}
+	
 	// Directory orientated operations
 	virtual void enumerate_files(const std::function<void(const char *)> &each) = 0;
 	
 	virtual bool rename_file(const char *old_name, const char *new_name) = 0;
 	
+	// Rename old_name to new_name in one step, replacing any file already called new_name
+	virtual bool replace_file(const char *old_name, const char *new_name) {
+		return rename_file(old_name, new_name);
+	}
+	
 	virtual bool delete_file(const char *file_name) = 0;
 	
 	// Error handling
@@ -25,13 +25,24 @@
 //  SOFTWARE.
 //
 
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
 #include <cmath>
 #include <limits>
+#include <vector>
 #include "oops.h"
 #include "interpreter.h"
 #include "bitblt.h"
 
+#ifdef FORK_SNAPSHOTS
+#ifdef _WIN32
+#error "FORK_SNAPSHOTS requires fork()"
+#endif
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 inline bool between_and(int value, int min, int max) {
 	return value >= min && value <= max;
 }
@@ -44,6 +55,9 @@ Interpreter::Interpreter(IHardwareAbstractionLayer *halInterface, IFileSystem *f
 memory(halInterface)
 #endif
 {
+#ifdef ALLOCATION_PROFILING
+	memory.setAllocationSite(this);
+#endif
 }
 
 
@@ -83,6 +97,10 @@ int Interpreter::methodCache[1024] = {0};
 bool Interpreter::checkLowMemory = false;
 bool Interpreter::memoryIsLow = false;
 int Interpreter::lowSpaceSemaphore = 0;
+int Interpreter::snapshotSemaphore = 0;
+#ifdef FORK_SNAPSHOTS
+int Interpreter::snapshotProcess = 0;
+#endif
 int Interpreter::oopsLeftLimit = 0;
 int Interpreter::currentDisplay = 0;
 int Interpreter::currentDisplayWidth = 0;
@@ -107,8 +125,11 @@ bool Interpreter::init() {
 	checkLowMemory = false;
 	memoryIsLow = false;
 	lowSpaceSemaphore = NilPointer;
+	snapshotSemaphore = NilPointer;
 	oopsLeftLimit = 0;
 	wordsLeftLimit = 0;
+	headroomWordsFloor = HeapSegmentCount * (HeapSpaceStop + 1);
+	headroomOopsFloor = ObjectTableSize / 2;
 	currentDisplay = 0;
 	currentCursor = 0;
 	currentDisplayWidth = 0;
@@ -1016,8 +1037,12 @@ void Interpreter::primitiveSnapshot() {
 	memory.storePointer_ofObject_withValue(SuspendedContextIndex, activeProcess, activeContext);
 	storeContextRegisters();
 	
-	memory.garbageCollect();
-	memory.saveSnapshot(fileSystem, hal->get_image_name());
+	memory.garbageCollect(GCSnapshot);
+#ifdef FORK_SNAPSHOTS
+	saveSnapshotInBackground();
+#else
+	snapshotWritten(memory.saveSnapshot(fileSystem, hal->get_image_name()));
+#endif
 	
 	/* This is poorly documented by the Bluebook. There is an actual return value that is important.
     see snapshotAs:thenQuit: in the Smalltalk sources. When the system resumes a snapshot the interpreter will be
@@ -1030,6 +1055,69 @@ void Interpreter::primitiveSnapshot() {
 	push(NilPointer); //  return of nil signals we just saved
 }
 
+#ifdef FORK_SNAPSHOTS
+
+void Interpreter::saveSnapshotInBackground() {
+	// The child process writes the snapshot from its copy of object memory, which shares
+	// pages with this one until either writes to them, while this process carries on. The
+	// child has only the thread that called fork(), and a lock another thread held at the
+	// time (such as the allocator's) is never released in it, so everything is allocated
+	// before the fork and the child does no more than write the file.
+	finishSnapshot(); // one at a time, as they write the same file
+
+#ifdef DELTA_SNAPSHOTS
+	// What the next delta is written against is kept by this process, so it writes them itself
+	if (memory.writesDeltaSnapshots()) {
+		snapshotWritten(memory.saveSnapshot(fileSystem, hal->get_image_name()));
+		return;
+	}
+#endif
+	if (!memory.beginSnapshot(fileSystem, hal->get_image_name(), false)) {
+		snapshotWritten(false);
+		return;
+	}
+	
+	pid_t child = fork();
+	if (child == 0)
+		_exit(memory.writeSnapshot(fileSystem) ? 0 : 1);
+	
+	if (child < 0) {
+		// No process to spare, so write it here
+		snapshotWritten(memory.endSnapshot(fileSystem, memory.writeSnapshot(fileSystem)));
+		return;
+	}
+	snapshotProcess = child;
+}
+
+void Interpreter::checkSnapshotCompletion() {
+	int status;
+	if (snapshotProcess != 0 && waitpid(snapshotProcess, &status, WNOHANG) == snapshotProcess) {
+		snapshotProcess = 0;
+		snapshotWritten(memory.endSnapshot(fileSystem, WIFEXITED(status) && WEXITSTATUS(status) == 0));
+	}
+}
+
+void Interpreter::finishSnapshot() {
+	int status;
+	if (snapshotProcess != 0) {
+		bool written = waitpid(snapshotProcess, &status, 0) == snapshotProcess &&
+		               WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		snapshotProcess = 0;
+		snapshotWritten(memory.endSnapshot(fileSystem, written));
+	}
+}
+
+#endif
+
+void Interpreter::snapshotWritten(bool saved) {
+	// The snapshot semaphore tells the image the snapshot is safely written, so it is only
+	// signalled when it is
+	if (!saved)
+		fprintf(stderr, "Snapshot could not be written to %s\n", hal->get_image_name());
+	else if (snapshotSemaphore != NilPointer)
+		asynchronousSignal(snapshotSemaphore);
+}
+
 void Interpreter::primitiveTimeWordsInto() {
 	/*
      The argument is a byte indexable object of length at least four.  Store
@@ -1253,11 +1341,130 @@ void Interpreter::primitiveScanCharacters() {
 }
 
 void Interpreter::primitiveDrawLoop() {
+
+#ifndef IMPLEMENT_PRIMITIVE_DRAW_LOOP
 	primitiveFail();    // optional
+#else
+	
+	// drawLoopX: xDelta Y: yDelta, sent to a BitBlt (a Pen)
+	int yDelta = popInteger();
+	int xDelta = popInteger();
+	int bitBltPointer = stackTop();
+	int destForm = memory.fetchPointer_ofObject(DestFormIndex, bitBltPointer);
+	int sourceForm = memory.fetchPointer_ofObject(SourceFormIndex, bitBltPointer);
+	int destX = fetchInteger_ofObject(DestXIndex, bitBltPointer);
+	int destY = fetchInteger_ofObject(DestYIndex, bitBltPointer);
+	int clipX = fetchInteger_ofObject(ClipXIndex, bitBltPointer);
+	int clipY = fetchInteger_ofObject(ClipYIndex, bitBltPointer);
+	int clipWidth = fetchInteger_ofObject(ClipWidthIndex, bitBltPointer);
+	int clipHeight = fetchInteger_ofObject(ClipHeightIndex, bitBltPointer);
+	int sourceX = fetchInteger_ofObject(SourceXIndex, bitBltPointer);
+	int sourceY = fetchInteger_ofObject(SourceYIndex, bitBltPointer);
+	int width = fetchInteger_ofObject(WidthIndex, bitBltPointer);
+	int height = fetchInteger_ofObject(HeightIndex, bitBltPointer);
+	int rule = fetchInteger_ofObject(CombinationRuleIndex, bitBltPointer);
+	
+	set_success(between_and(rule, 0, 15));
+	// The end of the line must fit in destX and destY once it has been drawn
+	set_success(isIntegerValue(destX + xDelta) && isIntegerValue(destY + yDelta));
+	if (success()) {
+		BitBlt bitBlt(memory,
+		              destForm,
+		              sourceForm,
+		              memory.fetchPointer_ofObject(HalftoneFormIndex, bitBltPointer),
+		              rule,
+		              destX,
+		              destY,
+		              width,
+		              height,
+		              sourceX,
+		              sourceY,
+		              clipX,
+		              clipY,
+		              clipWidth,
+		              clipHeight);
+		
+		// Nothing has been drawn if it fails, as the forms are bad
+		set_success(bitBlt.drawLoopX_Y(xDelta, yDelta));
+		if (success()) {
+			bitBlt.getDestination(&destX, &destY);
+			storeInteger_ofObject_withValue(DestXIndex, bitBltPointer, destX);
+			storeInteger_ofObject_withValue(DestYIndex, bitBltPointer, destY);
+			
+			// One update covers the whole line
+			int updatedX, updatedY, updatedWidth, updatedHeight;
+			if (destForm == currentDisplay) {
+				bitBlt.getUpdatedBounds(&updatedX, &updatedY, &updatedWidth, &updatedHeight);
+				if (updatedWidth > 0 && updatedHeight > 0)
+					updateDisplay(destForm, updatedX, updatedY, updatedWidth, updatedHeight);
+			}
+		}
+	}
+	
+	if (!success())
+		unPop(2);
+#endif
 }
 
 void Interpreter::primitiveStringReplace() {
+
+#ifndef IMPLEMENT_PRIMITIVE_STRING_REPLACE
 	primitiveFail();    // optional
+#else
+	
+	// replaceFrom: start to: stop with: replacement startingAt: replacementStart
+	int replacementStart = popInteger();
+	int replacement = popStack();
+	int stop = popInteger();
+	int start = popInteger();
+	int destination = popStack();
+	
+	if (success()) {
+		set_success(!isIntegerObject(destination) && !isIntegerObject(replacement));
+	}
+	
+	if (success()) {
+		int destinationClass = memory.fetchClassOf(destination);
+		int replacementClass = memory.fetchClassOf(replacement);
+		
+		// Both must hold the same kind of element. CompiledMethods mix literals and bytecodes,
+		// and Symbols may not be changed, so those are left to the Smalltalk code.
+		set_success(isIndexable(destinationClass) && isIndexable(replacementClass));
+		set_success(isWords(destinationClass) == isWords(replacementClass) &&
+		            isPointers(destinationClass) == isPointers(replacementClass));
+		set_success(destinationClass != ClassCompiledMethod && replacementClass != ClassCompiledMethod &&
+		            destinationClass != ClassSymbolPointer);
+		// Only where the indexes are those of the fields. Collections with named instance
+		// variables, such as OrderedCollection, may index their fields from elsewhere.
+		set_success(fixedFieldsOf(destinationClass) == 0 && fixedFieldsOf(replacementClass) == 0);
+		
+		if (success()) {
+			int count = stop - start + 1;
+			
+			set_success(start >= 1 && count >= 0 && stop <= lengthOf(destination));
+			set_success(replacementStart >= 1 && replacementStart + count - 1 <= lengthOf(replacement));
+			
+			if (success() && count > 0) {
+				int sourceIndex = replacementStart - 1;
+				int destinationIndex = start - 1;
+				if (!isWords(destinationClass))
+					memory.copyBytes_from_ofObject_to_ofObject(count, sourceIndex, replacement,
+					                                           destinationIndex, destination);
+				else if (!isPointers(destinationClass))
+					memory.copyWords_from_ofObject_to_ofObject(count, sourceIndex, replacement,
+					                                           destinationIndex, destination);
+				else
+					memory.copyPointers_from_ofObject_to_ofObject(count, sourceIndex, replacement,
+					                                              destinationIndex, destination);
+			}
+		}
+	}
+	
+	if (success())
+		push(destination);
+	else
+		unPop(5);
+#endif
 }
 
 bool Interpreter::lookupMethodInDictionary(int dictionary) {
@@ -2058,6 +2265,29 @@ bool Interpreter::isInLowMemoryCondition() {
 	        coreLeft < wordsLeftLimit);
 }
 
+void Interpreter::reclaimHeadroom(int percent) {
+	// Called between frames, so that garbage is collected while there is still room rather
+	// than by checkProcessSwitch or an allocation failure in the middle of something
+	int wordsWanted = HeapSegmentCount * (HeapSpaceStop + 1) / 100 * percent;
+	int oopsWanted = ObjectTableSize / 2 / 100 * percent;
+	
+	// once there is room again, collect as soon as it is used up
+	if ((int) coreLeft >= wordsWanted)
+		headroomWordsFloor = wordsWanted;
+	if (oopsLeft >= oopsWanted)
+		headroomOopsFloor = oopsWanted;
+	
+	if ((int) coreLeft >= headroomWordsFloor && oopsLeft >= headroomOopsFloor)
+		return;
+	
+	memory.garbageCollect(GCHeadroom);
+	
+	// If the collection could not get back above the headroom, wait until another quarter of
+	// it has been used before collecting again rather than collecting every frame
+	headroomWordsFloor = std::min(wordsWanted, (int) coreLeft - wordsWanted / 4);
+	headroomOopsFloor = std::min(oopsWanted, oopsLeft - oopsWanted / 4);
+}
+
 void Interpreter::checkProcessSwitch() {
 	int theActiveProcess;
 	
@@ -2094,7 +2324,7 @@ void Interpreter::checkProcessSwitch() {
 		    oopsLeftLimit > 0 && wordsLeftLimit > 0) {
 			
 			if (isInLowMemoryCondition()) {
-				memory.garbageCollect(); // Try to get some memory back...
+				memory.garbageCollect(GCLowSpace); // Try to get some memory back...
 				if (isInLowMemoryCondition()) {
 					memoryIsLow = true;
 					if (!memoryWasLow)
@@ -2476,6 +2706,21 @@ void Interpreter::dispatchPrivatePrimitives() {
 		case 133: // Posix error string
 			primitivePosixErrorStringOperation();
 			break;
+		case 134: // Compact the heap
+			primitiveCompactHeap();
+			break;
+		case 136: // Write the allocation profile
+			primitiveWriteAllocationProfile();
+			break;
+		case 137: // Garbage collection statistics
+			primitiveGCStatistics();
+			break;
+		case 138: // Become the elements of two Arrays
+			primitiveArrayBecome();
+			break;
+		case 139: // Semaphore to signal when a snapshot has been written
+			primitiveSignalAtSnapshotCompletion();
+			break;
 		default:
 			primitiveFail();
 			break;
@@ -2492,6 +2737,121 @@ void Interpreter::primitiveBeSnapshotFile() {
 	hal->set_image_name(fileName.c_str());
 }
 
+void Interpreter::primitiveCompactHeap() {
+	// Answers the number of free words recovered from between objects
+	int reclaimed = memory.compactHeap();
+	pop(1); // remove receiver
+	push(positive32BitIntegerFor(reclaimed));
+}
+
+void Interpreter::primitiveWriteAllocationProfile() {
+#ifndef ALLOCATION_PROFILING
+	primitiveFail();
+#else
+	// The argument is the name of the file to write. Counting starts afresh once it has been
+	// written, so each profile covers the allocations since the one before.
+	int fileNamePointer = popStack();
+	set_success(memory.fetchClassOf(fileNamePointer) == ClassStringPointer);
+	if (success())
+		set_success(writeAllocationProfile(stringFromObject(fileNamePointer).c_str()));
+	if (success())
+		memory.resetAllocationProfile();
+	else
+		unPop(1);
+#endif
+}
+
+void Interpreter::primitiveGCStatistics() {
+#ifndef GC_STATISTICS
+	primitiveFail();
+#else
+	// Answers an Array of
+	//   1-5   collections caused by allocation failure, low space, snapshot, request and headroom
+	//   6-8   last, longest and total pause (microseconds, total in milliseconds)
+	//   9-12  words and oops reclaimed by the last collection and by all of them
+	//   13    percentage of the free words lying between objects
+	//   14-15 reference count cascades and the longest (objects deallocated)
+	//   16-   the pause histogram, buckets doubling from under 125 microseconds
+	const GCStatistics &statistics = memory.gcStatistics();
+	std::uint32_t values[15 + GCPauseBuckets] = {
+		(std::uint32_t) statistics.collections[GCAllocationFailure],
+		(std::uint32_t) statistics.collections[GCLowSpace],
+		(std::uint32_t) statistics.collections[GCSnapshot],
+		(std::uint32_t) statistics.collections[GCRequested],
+		(std::uint32_t) statistics.collections[GCHeadroom],
+		(std::uint32_t) statistics.lastPauseMicroseconds,
+		(std::uint32_t) statistics.maxPauseMicroseconds,
+		(std::uint32_t) (statistics.totalPauseMicroseconds / 1000),
+		(std::uint32_t) statistics.lastWordsReclaimed,
+		(std::uint32_t) statistics.lastOopsReclaimed,
+		(std::uint32_t) statistics.wordsReclaimed,
+		(std::uint32_t) statistics.oopsReclaimed,
+		(std::uint32_t) statistics.fragmentation,
+		(std::uint32_t) statistics.cascades,
+		(std::uint32_t) statistics.maxCascade
+	};
+	for (int bucket = 0; bucket < GCPauseBuckets; bucket++)
+		values[15 + bucket] = (std::uint32_t) statistics.pauseHistogram[bucket];
+	
+	const int count = sizeof(values) / sizeof(values[0]);
+	pop(1); // remove receiver
+	int array = memory.instantiateClass_withPointers(ClassArrayPointer, count);
+	push(array); // on the stack, the array survives any collection caused by filling it in
+	for (int i = 0; i < count; i++)
+		memory.storePointer_ofObject_withValue(i, array, positive32BitIntegerFor(values[i]));
+#endif
+}
+
+void Interpreter::primitiveArrayBecome() {
+	// The receiver and argument are Arrays of the same size. Each element of the receiver
+	// becomes the corresponding element of the argument and vice versa, as primitiveBecome
+	// does for one pair. The object table entries are swapped, so no reference counts change.
+	// Fails, swapping nothing, if an element is a SmallInteger or appears more than once.
+	int otherArray = popStack();
+	int thisArray = popStack();
+	std::vector<int> these, others;
+	
+	set_success(memory.fetchClassOf(thisArray) == ClassArrayPointer);
+	set_success(memory.fetchClassOf(otherArray) == ClassArrayPointer);
+	if (success())
+		set_success(memory.fetchWordLengthOf(thisArray) == memory.fetchWordLengthOf(otherArray));
+	
+	if (success()) {
+		// The elements are collected first as either Array may itself be among them
+		int length = memory.fetchWordLengthOf(thisArray);
+		for (int i = 0; i < length; i++) {
+			these.push_back(memory.fetchPointer_ofObject(i, thisArray));
+			others.push_back(memory.fetchPointer_ofObject(i, otherArray));
+			set_success(!isIntegerObject(these.back()) && !isIntegerObject(others.back()));
+		}
+		
+		std::vector<int> all(these);
+		all.insert(all.end(), others.begin(), others.end());
+		std::sort(all.begin(), all.end());
+		set_success(std::adjacent_find(all.begin(), all.end()) == all.end());
+	}
+	
+	if (success()) {
+		for (size_t i = 0; i < these.size(); i++)
+			memory.swapPointersOf_and(these[i], others[i]);
+		push(thisArray);
+	}
+	else
+		unPop(2);
+}
+
+void Interpreter::primitiveSignalAtSnapshotCompletion() {
+	// The argument is a Semaphore to signal each time a snapshot has been written, or nil.
+	// With FORK_SNAPSHOTS this is after primitiveSnapshot has returned.
+	int semaphore = popStack();
+	
+	set_success(semaphore == NilPointer || memory.fetchClassOf(semaphore) == ClassSemaphorePointer);
+	if (success())
+		snapshotSemaphore = semaphore; // as with lowSpaceSemaphore, Smalltalk holds on to it
+	else
+		unPop(1);
+}
+
 void Interpreter::primitivePosixLastErrorOperation() {
 	pop(1);
 	pushInteger(fileSystem->last_error());
@@ -4037,7 +4397,7 @@ int Interpreter::stringObjectFor(const char *s) {
 	return objectPointer;
 }
 
-#ifdef DEBUG
+#if defined(DEBUG) || defined(ALLOCATION_PROFILING)
 //{
 //    return stringFromObject(selector);
 //}
@@ -4056,13 +4416,88 @@ std::string Interpreter::className(int classPointer)
 		return "UndefinedObject";
 	
 	int symbol = memory.fetchPointer_ofObject(6, classPointer);
-	if (memory.fetchClassOf(symbol) != ClassSymbolPointer)
-		return "<unknown>";
+	if (memory.fetchClassOf(symbol) == ClassSymbolPointer)
+		return stringFromObject(symbol);
 	
-	return stringFromObject(symbol);
+	// A metaclass keeps its sole instance in the same field
+	if (!isIntegerObject(symbol) && memory.fetchWordLengthOf(symbol) > 6) {
+		int name = memory.fetchPointer_ofObject(6, symbol);
+		if (memory.fetchClassOf(name) == ClassSymbolPointer)
+			return stringFromObject(name) + " class";
+	}
+	return "<unknown>";
 }
 #endif
 
+#ifdef ALLOCATION_PROFILING
+
+void Interpreter::currentAllocationSite(int &method, int &instructionPointer, int &receiverClass) {
+	method = Interpreter::method;
+	instructionPointer = Interpreter::instructionPointer;
+	receiverClass = memory.fetchClassOf(receiver);
+}
+
+std::string Interpreter::methodName(int method, int cls) {
+	for (; cls != NilPointer; cls = memory.fetchPointer_ofObject(SuperclassIndex, cls)) {
+		int dictionary = memory.fetchPointer_ofObject(MessageDictionaryIndex, cls);
+		int methodArray = memory.fetchPointer_ofObject(MethodArrayIndex, dictionary);
+		int length = memory.fetchWordLengthOf(dictionary);
+		for (int index = SelectorStart; index < length; index++) {
+			if (memory.fetchPointer_ofObject(index - SelectorStart, methodArray) == method)
+				return className(cls) + ">>" + stringFromObject(memory.fetchPointer_ofObject(index, dictionary));
+		}
+	}
+	return "<unknown method>";
+}
+
+bool Interpreter::writeAllocationProfile(const char *fileName) {
+	// Classes by words allocated, then allocation sites by samples
+	std::string report;
+	char line[256];
+	
+	std::vector<std::pair<int, ObjectMemory::AllocationCount>> classes(
+		memory.allocationsByClass().begin(), memory.allocationsByClass().end());
+	std::sort(classes.begin(), classes.end(), [](const std::pair<int, ObjectMemory::AllocationCount> &a,
+	                                             const std::pair<int, ObjectMemory::AllocationCount> &b) {
+		return a.second.words > b.second.words;
+	});
+	
+	report += "Allocations by class\n\n       objects          words  class\n";
+	for (const auto &entry : classes) {
+		snprintf(line, sizeof(line), "%14llu %14llu  %s\n",
+		         (unsigned long long) entry.second.objects, (unsigned long long) entry.second.words,
+		         className(entry.first).c_str());
+		report += line;
+	}
+	
+	std::vector<ObjectMemory::SampledAllocationSite> sites = memory.sampledAllocationSites();
+	std::sort(sites.begin(), sites.end(), [](const ObjectMemory::SampledAllocationSite &a,
+	                                         const ObjectMemory::SampledAllocationSite &b) {
+		return a.samples > b.samples;
+	});
+	
+	snprintf(line, sizeof(line), "\nSampled allocation sites (1 in %d allocations)\n\n       samples  class  <-  method @ instruction pointer\n",
+	         ALLOCATION_SAMPLE_INTERVAL);
+	report += line;
+	for (const auto &site : sites) {
+		// The method may have been collected since it was sampled
+		bool isMethod = memory.hasObject(site.method) && memory.fetchClassOf(site.method) == ClassCompiledMethod;
+		std::string where = isMethod ? methodName(site.method, site.receiverClass) : "<collected method>";
+		snprintf(line, sizeof(line), "%14llu  %s  <-  %s @ %d\n", (unsigned long long) site.samples,
+		         className(site.classPointer).c_str(), where.c_str(), site.instructionPointer);
+		report += line;
+	}
+	
+	int fd = fileSystem->create_file(fileName);
+	if (fd == -1)
+		return false;
+	bool written = fileSystem->write(fd, report.data(), (int) report.size()) == (int) report.size();
+	fileSystem->close_file(fd);
+	return written;
+}
+
+#endif
+
 void Interpreter::sendSelector_argumentCount(int selector, int count) {
 	int newReceiver;
 	
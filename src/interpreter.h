@@ -131,6 +131,11 @@
 class Interpreter
 #ifdef GC_MARK_SWEEP
 	: IGCNotification
+#ifdef ALLOCATION_PROFILING
+	, IAllocationSite
+#endif
+#elif defined(ALLOCATION_PROFILING)
+	: IAllocationSite
 #endif
 {
 public:
@@ -145,7 +150,39 @@ public:
 		checkLowMemory = true;
 	}
 	
+	// Collect garbage if the free words or oops are below percent of the heap or object table
+	void reclaimHeadroom(int percent);
+
+#ifdef NATIVE_IMAGES
+	// Write snapshots as native images rather than in the interchange format
+	inline void setNativeSnapshots(bool native) {
+		memory.setNativeSnapshots(native);
+	}
+#endif
+
+#ifdef COMPRESSED_SNAPSHOTS
+	// Compress snapshots written in the interchange format
+	inline void setCompressedSnapshots(bool compressed) {
+		memory.setCompressedSnapshots(compressed);
+	}
+#endif
+
+#ifdef DELTA_SNAPSHOTS
+	// Write snapshots as deltas against the native image they replace
+	inline void setDeltaSnapshots(bool delta) {
+		memory.setDeltaSnapshots(delta);
+	}
+#endif
+	
 	void asynchronousSignal(int aSemaphore);
+
+#ifdef FORK_SNAPSHOTS
+	// Signal the snapshot semaphore if the process writing a snapshot has finished
+	void checkSnapshotCompletion();
+	
+	// Wait for the process writing a snapshot, if there is one
+	void finishSnapshot();
+#endif
 	
 	int lastBytecode() {
 		// Debug/testing
@@ -159,6 +196,17 @@ public:
 		return memory.fetchWord_ofObject(wordIndex, displayBits);
 	}
 
+#ifdef ALLOCATION_PROFILING
+	// Write the allocation counts and sampled allocation sites as text
+	bool writeAllocationProfile(const char *fileName);
+#endif
+
+#ifdef GC_STATISTICS
+	inline std::string gcStatisticsSummary() const {
+		return memory.gcStatisticsSummary();
+	}
+#endif
+
 private:
 	
 	void error(const char *message);
@@ -363,6 +411,12 @@ private:
 	void primitiveCopyBits();
 	
 	void primitiveSnapshot();
+
+#ifdef FORK_SNAPSHOTS
+	void saveSnapshotInBackground();
+#endif
+	
+	void snapshotWritten(bool saved);
 	
 	void primitiveTimeWordsInto();
 	
@@ -573,6 +627,16 @@ private:
 	
 	void primitivePosixErrorStringOperation();
 	
+	void primitiveCompactHeap();
+	
+	void primitiveWriteAllocationProfile();
+	
+	void primitiveGCStatistics();
+	
+	void primitiveArrayBecome();
+	
+	void primitiveSignalAtSnapshotCompletion();
+	
 	// --- PrimitiveTest ---
 		/* "source"
 		 success <- successValue & success
@@ -1111,6 +1175,15 @@ private:
 
 #endif
 
+#ifdef ALLOCATION_PROFILING
+	
+	void currentAllocationSite(int &method, int &instructionPointer, int &receiverClass);
+	
+	// "Class>>selector" for a method found in the method dictionary of cls or a superclass
+	std::string methodName(int method, int cls);
+
+#endif
+
 private:
 	
 	// "Registers"
@@ -1154,9 +1227,19 @@ private:
 	static bool checkLowMemory;
 	static bool memoryIsLow;
 	static int lowSpaceSemaphore;
+	
+	// primitiveSignalAtSnapshotCompletion support
+	static int snapshotSemaphore;
+#ifdef FORK_SNAPSHOTS
+	static int snapshotProcess; // the process writing a snapshot, or 0
+#endif
 	static int oopsLeftLimit;
 	std::uint32_t wordsLeftLimit;
 	
+	// reclaimHeadroom collects once free words or oops fall below these
+	int headroomWordsFloor;
+	int headroomOopsFloor;
+	
 	IHardwareAbstractionLayer *hal;
 	IFileSystem *fileSystem;
 	static int currentDisplay;
@@ -1171,6 +1254,8 @@ private:
 
 #ifdef DEBUG
 	std::string selectorName(int selector);
+#endif
+#if defined(DEBUG) || defined(ALLOCATION_PROFILING)
 	std::string classNameOfObject(int objectPointer);
 	std::string className(int classPointer);
 #endif
@@ -44,6 +44,19 @@ static void help(const std::string exe_name){
 			  << "  -cycles : Cycles per frame (default:1800)\n"
 			  << "  -scale  : Override default 1x scale\n"
 			  << "  -three  : Enable three button mouse\n"
+#ifdef NATIVE_IMAGES
+			  << "  -native : Write snapshots as native images\n"
+#endif
+#ifdef COMPRESSED_SNAPSHOTS
+			  << "  -compress : Compress snapshots\n"
+#endif
+#ifdef DELTA_SNAPSHOTS
+			  << "  -delta  : Write snapshots as deltas against the native image\n"
+#endif
+#ifdef GC_STATISTICS
+			  << "  -gclog  : Log garbage collection statistics every so many seconds\n"
+#endif
+			  << "  -headroom : Collect garbage between frames below this percentage free\n"
 			  << "  -help   : Show this message\n";
 	
 	exit(0);
@@ -90,10 +103,38 @@ static bool process_args(int argc, const char *argv[], struct options &options)
 				return false;
 			options.display_scale = scale;
 		}
+#ifdef GC_STATISTICS
+		else if (strcmp(argv[arg], "-gclog") == 0 && arg + 1 < argc) {
+			arg++;
+			int interval = atoi(argv[arg]);
+			if (interval < 0)
+				return false;
+			options.gc_log_interval = interval;
+		}
+#endif
+		else if (strcmp(argv[arg], "-headroom") == 0 && arg + 1 < argc) {
+			arg++;
+			int percent = atoi(argv[arg]);
+			if (percent < 0 || percent > 100)
+				return false;
+			options.gc_headroom = percent;
+		}
 		else if (strcmp(argv[arg], "-vsync") == 0)
 			options.vsync = true;
 		else if (strcmp(argv[arg], "-three") == 0)
 			options.three_buttons = true;
+#ifdef NATIVE_IMAGES
+		else if (strcmp(argv[arg], "-native") == 0)
+			options.native_snapshots = true;
+#endif
+#ifdef COMPRESSED_SNAPSHOTS
+		else if (strcmp(argv[arg], "-compress") == 0)
+			options.compressed_snapshots = true;
+#endif
+#ifdef DELTA_SNAPSHOTS
+		else if (strcmp(argv[arg], "-delta") == 0)
+			options.delta_snapshots = true;
+#endif
 		else if (strcmp(argv[arg], "-help") == 0)
 			help(argv[0]);
 		else
@@ -115,6 +156,11 @@ int main(int argc, const char *argv[]) {
 	vm_options.novsync_delay = 0;  // Try -delay 8 arg if your CPU is unhappy
 	vm_options.cycles_per_frame = 1800;
 	vm_options.display_scale = 1;
+	vm_options.gc_log_interval = 0;
+	vm_options.gc_headroom = 0;
+	vm_options.native_snapshots = false;
+	vm_options.compressed_snapshots = false;
+	vm_options.delta_snapshots = false;
 	
 	if (!process_args(argc, argv, vm_options))
 		help(argv[0]);
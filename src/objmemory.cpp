@@ -26,16 +26,48 @@
 //
 
 #include <algorithm>
+#include <iterator>
+#include <cstring>
+#include <string>
+#include <vector>
+#ifdef GC_STATISTICS
+#include <chrono>
+#include <cstdio>
+#endif
 #include "objmemory.h"
 #include "oops.h"
 
+#ifdef PARALLEL_MARKING
+#include <deque>
+#include <mutex>
+#include <thread>
+#endif
+
+#if defined(COMPRESSED_SNAPSHOTS) || defined(SNAPSHOT_CHECKSUMS) || defined(PARALLEL_LOADING)
+#include <thread>
+#endif
+
+#ifdef NATIVE_IMAGES
+#include <chrono>
+#include <random>
+#endif
+
 #ifndef GC_REF_COUNT
 #ifndef GC_MARK_SWEEP
 #error "must define GC_REF_COUNT and/or GC_MARK_SWEEP"
 #endif
 #endif
 
+#if defined(NATIVE_IMAGES) && !defined(_WIN32)
+// Aligned to the largest page size in use so a native image can be mapped over it
+alignas(NativeImageHeaderSize) std::uint16_t real_memory[SegmentCount][SegmentSize];
+#else
 std::uint16_t real_memory[SegmentCount][SegmentSize];
+#endif
+
+#ifdef NATIVE_IMAGES
+bool ObjectMemory::imageMapped = false;
+#endif
 
 int ObjectMemory::currentSegment = -1;
 int ObjectMemory::freeWords = 0; // free words remaining (make primitiveFreeCore "fast")
@@ -44,6 +76,63 @@ int ObjectMemory::freeWords = 0; // free words remaining (make primitiveFreeCore
 // (free bit clear but count field zero) of memory is counted as a free oop
 int ObjectMemory::freeOops = 0;  // free OT entries (make primitiveFreeOops "fast")
 
+#ifdef SIZE_CLASS_REGIONS
+int ObjectMemory::sizeClassRegions[HeapSegmentCount][BigSize];
+#endif
+
+#ifdef ZEROED_FREE_SPACE
+int ObjectMemory::zeroedSpaceStart[HeapSegmentCount];
+int ObjectMemory::zeroedSpaceStop[HeapSegmentCount];
+#endif
+
+#ifdef OBJECT_ADDRESS_TABLE
+std::uint32_t ObjectMemory::objectAddresses[ObjectTableSize / 2];
+#endif
+
+#ifdef OBJECT_TABLE_BITMAP
+std::uint64_t ObjectMemory::usedEntries[(ObjectTableSize / 2 + 63) / 64];
+int ObjectMemory::usedEntriesLimit = 0;
+#endif
+
+#ifdef PARALLEL_MARKING
+#ifndef GC_MARK_SWEEP
+#error "PARALLEL_MARKING requires GC_MARK_SWEEP"
+#endif
+
+std::atomic<std::uint32_t> ObjectMemory::markBits[(ObjectTableSize / 2 + 31) / 32];
+
+// The owner pushes and pops objects at the back, idle threads steal from the front
+struct MarkStack {
+	std::mutex lock;
+	std::deque<int> objectPointers;
+};
+
+// A marker takes this many objects from its stack at a time, and gives back this many once it
+// holds twice as many, so the lock is taken once per batch rather than once per object
+static const std::size_t MarkBatchSize = 64;
+
+// The number of threads that mark, one meaning the sequential marker is used instead
+static int markingThreadCount() {
+	static const int threadCount = PARALLEL_MARKING_THREADS > 0 ? PARALLEL_MARKING_THREADS :
+	                               std::max(1, (int) std::thread::hardware_concurrency());
+	return threadCount;
+}
+#endif
+
+#ifdef BITMAP_MARKING
+#ifndef GC_MARK_SWEEP
+#error "BITMAP_MARKING requires GC_MARK_SWEEP"
+#endif
+#ifdef PARALLEL_MARKING
+#error "PARALLEL_MARKING and BITMAP_MARKING are alternatives"
+#endif
+
+std::uint32_t ObjectMemory::markBits[(ObjectTableSize / 2 + 31) / 32];
+int ObjectMemory::markStack[MarkStackSize];
+int ObjectMemory::markStackTop = 0;
+bool ObjectMemory::markStackOverflowed = false;
+#endif
+
 #ifdef GC_MARK_SWEEP
 
 ObjectMemory::ObjectMemory(IHardwareAbstractionLayer *halInterface, IGCNotification *notification) {
@@ -58,28 +147,375 @@ ObjectMemory::ObjectMemory(IHardwareAbstractionLayer *halInterface) {
 }
 #endif
 
-bool ObjectMemory::loadObjectTable(IFileSystem *fileSystem, int fd) {
+#if defined(CHECK_MAPPED_IMAGES) && !defined(SNAPSHOT_CHECKSUMS)
+#error "CHECK_MAPPED_IMAGES requires SNAPSHOT_CHECKSUMS"
+#endif
+
+#ifdef SNAPSHOT_CHECKSUMS
+
+static std::uint32_t snapshotChecksumOf(const char *bytes, int count) {
+	// Fletcher's checksum over 32-bit words (and then any odd bytes), folded to 32 bits
+	std::uint64_t sum = 0, sumOfSums = 0;
+	int index = 0;
+	for (; index + 4 <= count; index += 4) {
+		std::uint32_t word;
+		std::memcpy(&word, bytes + index, sizeof(word));
+		sum += word;
+		sumOfSums += sum;
+	}
+	for (; index < count; index++) {
+		sum += (std::uint8_t) bytes[index];
+		sumOfSums += sum;
+	}
+	std::uint64_t checksum = sum ^ (sumOfSums * 0x9e3779b97f4a7c15ull);
+	return (std::uint32_t) (checksum ^ (checksum >> 32));
+}
+
+struct SnapshotChunk {
+	int offset;
+	int length;
+	std::uint32_t checksum;
+};
+
+// Check the chunks on as many threads as there are processors
+static bool snapshotChunksAreIntact(const char *bytes, const std::vector<SnapshotChunk> &chunks) {
+	int threadCount = std::min((int) chunks.size(), std::max(1, (int) std::thread::hardware_concurrency()));
+	std::vector<char> intact(threadCount, 1);
+	auto check = [&](int worker) {
+		for (int index = worker; index < (int) chunks.size(); index += threadCount) {
+			const SnapshotChunk &chunk = chunks[index];
+			if (snapshotChecksumOf(bytes + chunk.offset, chunk.length) != chunk.checksum) {
+				intact[worker] = 0;
+				return;
+			}
+		}
+	};
+	
+	std::vector<std::thread> threads;
+	for (int worker = 1; worker < threadCount; worker++)
+		threads.emplace_back(check, worker);
+	if (threadCount > 0)
+		check(0);
+	for (auto &thread : threads)
+		thread.join();
+	return std::all_of(intact.begin(), intact.end(), [](char chunkIntact) { return chunkIntact != 0; });
+}
+
+// Check an interchange format image against its checksum block, if it has one
+static bool interchangeImageIsIntact(std::vector<char> &image) {
+	if (image.size() < ObjectSpaceBaseInImage ||
+	    std::memcmp(&image[SnapshotChecksumsBase], SnapshotChecksumMagic, std::strlen(SnapshotChecksumMagic)) != 0)
+		return true; // written without one
+	
+	SnapshotChecksums block;
+	std::memcpy(&block, &image[SnapshotChecksumsBase], sizeof(block));
+	int size = (int) image.size();
+	if (block.chunkSize == 0 || block.chunkCount > SnapshotChecksumsLimit ||
+	    block.chunkCount != (size + block.chunkSize - 1) / block.chunkSize)
+		return false;
 	
-	// First two 32-bit values have the object space length and object table lengths in words
-	std::int32_t objectTableLength;
+	// The checksums were taken with the block zeroed
+	std::memset(&image[SnapshotChecksumsBase], 0, sizeof(block));
+	std::vector<SnapshotChunk> chunks;
+	for (int index = 0; index < (int) block.chunkCount; index++) {
+		int offset = index * (int) block.chunkSize;
+		chunks.push_back({offset, std::min((int) block.chunkSize, size - offset), block.checksums[index]});
+	}
+	return snapshotChunksAreIntact(image.data(), chunks);
+}
+
+#endif
+
+#ifdef COMPRESSED_SNAPSHOTS
+
+// A compressed image is this header followed by blocks, each of which holds up to
+// PackedImageBlockSize bytes of an interchange format image. A block is its unpacked and
+// packed sizes as 32-bit values followed by the packed bytes, or by the bytes themselves
+// when packing did not make them any smaller. Blocks are packed independently. In version 2
+// the sizes are followed by a checksum of the unpacked bytes (SNAPSHOT_CHECKSUMS).
+#define PackedImageMagic "ST80LZ77"
+#ifdef SNAPSHOT_CHECKSUMS
+#define PackedImageVersion 2
+#else
+#define PackedImageVersion 1
+#endif
+#define PackedBlockHeaderSize (PackedImageVersion == 1 ? 8 : 12)
+#define PackedImageBlockSize (256 * 1024)
+
+struct PackedImageHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t blockSize;
+};
+
+// Blocks are packed with a simple LZ77 in the style of LZ4: each sequence is a token byte
+// holding the counts of literals and of matched bytes beyond the minimum, any further count
+// bytes for the literals, the literals, the 16-bit offset back to the match and any further
+// count bytes for the match. The last sequence has only literals.
+#define PackedMinimumMatch 4
+#define PackedHashBits 14
+
+static inline int packedBound(int length) {
+	return length + length / 255 + 16;
+}
+
+static inline void putPackedCount(std::uint8_t *&out, int count) {
+	for (; count >= 255; count -= 255)
+		*out++ = 255;
+	*out++ = (std::uint8_t) count;
+}
+
+static int packBlock(const std::uint8_t *source, int length, std::uint8_t *packed, int *recent) {
+	std::fill(recent, recent + (1 << PackedHashBits), -1); // where each hash of 4 bytes last was
+	std::uint8_t *out = packed;
+	int anchor = 0; // start of the literals not yet written
+	
+	for (int position = 0; position + PackedMinimumMatch <= length;) {
+		std::uint32_t sequence;
+		std::memcpy(&sequence, source + position, sizeof(sequence));
+		int hash = (int) ((sequence * 2654435761u) >> (32 - PackedHashBits));
+		int candidate = recent[hash];
+		recent[hash] = position;
+		
+		if (candidate < 0 || position - candidate > 0xffff ||
+		    std::memcmp(source + candidate, source + position, PackedMinimumMatch) != 0) {
+			position++;
+			continue;
+		}
+		
+		int matchLength = PackedMinimumMatch;
+		while (position + matchLength < length && source[candidate + matchLength] == source[position + matchLength])
+			matchLength++;
+		
+		int literals = position - anchor;
+		int extraMatch = matchLength - PackedMinimumMatch;
+		*out++ = (std::uint8_t) ((std::min(literals, 15) << 4) | std::min(extraMatch, 15));
+		if (literals >= 15)
+			putPackedCount(out, literals - 15);
+		std::memcpy(out, source + anchor, literals);
+		out += literals;
+		int offset = position - candidate;
+		*out++ = (std::uint8_t) offset;
+		*out++ = (std::uint8_t) (offset >> 8);
+		if (extraMatch >= 15)
+			putPackedCount(out, extraMatch - 15);
+		
+		position += matchLength;
+		anchor = position;
+	}
+	
+	int literals = length - anchor;
+	*out++ = (std::uint8_t) (std::min(literals, 15) << 4);
+	if (literals >= 15)
+		putPackedCount(out, literals - 15);
+	std::memcpy(out, source + anchor, literals);
+	out += literals;
+	return (int) (out - packed);
+}
+
+static inline bool getPackedCount(const std::uint8_t *&in, const std::uint8_t *end, int &count) {
+	std::uint8_t byte;
+	do {
+		if (in == end)
+			return false;
+		byte = *in++;
+		count += byte;
+	} while (byte == 255);
+	return true;
+}
+
+static bool unpackBlock(const std::uint8_t *packed, int packedLength, std::uint8_t *out, int length) {
+	const std::uint8_t *in = packed, *end = packed + packedLength;
+	int position = 0;
+	
+	while (in < end) {
+		int token = *in++;
+		int literals = token >> 4;
+		if (literals == 15 && !getPackedCount(in, end, literals))
+			return false;
+		if (literals > end - in || literals > length - position)
+			return false;
+		std::memcpy(out + position, in, literals);
+		in += literals;
+		position += literals;
+		if (in == end)
+			break; // the last sequence
+		
+		if (end - in < 2)
+			return false;
+		int offset = in[0] | (in[1] << 8);
+		in += 2;
+		int matchLength = token & 15;
+		if (matchLength == 15 && !getPackedCount(in, end, matchLength))
+			return false;
+		matchLength += PackedMinimumMatch;
+		if (offset == 0 || offset > position || matchLength > length - position)
+			return false;
+		
+		// Byte by byte, since a match may overlap the bytes it produces
+		for (int index = 0; index < matchLength; index++, position++)
+			out[position] = out[position - offset];
+	}
+	return position == length;
+}
+
+// Replace a compressed image with the interchange format image it holds
+static bool unpackImage(std::vector<char> &image) {
+	PackedImageHeader header;
+	std::memcpy(&header, image.data(), sizeof(header));
+	if (header.version < 1 || header.version > 2 || header.blockSize == 0 || header.blockSize > PackedImageBlockSize)
+		return false;
 	
-	if (fileSystem->seek_to(fd, 4) == -1) // Skip over object space length
+	std::vector<char> unpacked;
+#ifdef SNAPSHOT_CHECKSUMS
+	std::vector<SnapshotChunk> chunks;
+#endif
+	std::size_t position = sizeof(header);
+	std::size_t blockHeaderSize = header.version == 1 ? 8 : 12;
+	while (position < image.size()) {
+		std::uint32_t sizes[3]; // unpacked, packed, checksum (from version 2)
+		if (image.size() - position < blockHeaderSize)
+			return false;
+		std::memcpy(sizes, image.data() + position, blockHeaderSize);
+		position += blockHeaderSize;
+		if (sizes[0] > header.blockSize || sizes[1] > image.size() - position || sizes[1] > (std::uint32_t) packedBound(sizes[0]))
+			return false;
+		
+		std::size_t start = unpacked.size();
+		unpacked.resize(start + sizes[0]);
+		const std::uint8_t *packed = (const std::uint8_t *) image.data() + position;
+		std::uint8_t *out = (std::uint8_t *) unpacked.data() + start;
+		if (sizes[1] == sizes[0])
+			std::memcpy(out, packed, sizes[0]);
+		else if (!unpackBlock(packed, sizes[1], out, sizes[0]))
+			return false;
+		position += sizes[1];
+#ifdef SNAPSHOT_CHECKSUMS
+		if (header.version >= 2)
+			chunks.push_back({(int) start, (int) sizes[0], sizes[2]});
+#endif
+	}
+	
+#ifdef SNAPSHOT_CHECKSUMS
+	if (!snapshotChunksAreIntact(unpacked.data(), chunks))
+		return false;
+#endif
+	image.swap(unpacked);
+	return true;
+}
+
+#endif
+
+#ifdef BYTE_SWAPPED_IMAGES
+
+static std::uint32_t byteSwapped(std::uint32_t value) {
+	return (value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000) | (value << 24);
+}
+
+// Swap the bytes of count words. Kept to a plain loop so the compiler vectorizes it.
+static void swapBytesOfWords(std::uint16_t *words, int count) {
+	for (int index = 0; index < count; index++)
+		words[index] = (std::uint16_t) ((words[index] << 8) | (words[index] >> 8));
+}
+
+// Whether an interchange format image came from a host of the other byte order, such as the
+// original big endian Xerox images: its lengths only make sense with their bytes swapped
+static bool imageIsByteSwapped(const std::vector<char> &image) {
+	if (image.size() < ObjectSpaceBaseInImage)
 		return false;
+	std::uint32_t lengths[2];
+	std::memcpy(lengths, image.data(), sizeof(lengths));
+	std::uint64_t space = image.size() - ObjectSpaceBaseInImage; // in bytes
+	auto plausible = [space](std::uint32_t objectSpaceLength, std::uint32_t objectTableLength) {
+		return objectTableLength <= ObjectTableSize && objectTableLength * 2ull <= space &&
+		       objectSpaceLength * 2ull <= space;
+	};
+	return !plausible(lengths[0], lengths[1]) && plausible(byteSwapped(lengths[0]), byteSwapped(lengths[1]));
+}
+
+// Bring an image from a host of the other byte order into this one, as misc/imageswapper.c
+// did beforehand. Following the Xerox Virtual Image booklet, the fields accessed as words
+// are swapped and those accessed as bytes are not:
+//   For word-type objects: swap every field.
+//   For CompiledMethods: swap Length, Class, Header and Literal fields only.
+//   For all other byte-type objects: swap Length and Class fields only.
+// A Float's two words are exchanged as well, since it is kept low word first.
+static bool swapImageByteOrder(std::vector<char> &image) {
+	std::uint32_t lengths[2];
+	std::memcpy(lengths, image.data(), sizeof(lengths));
+	lengths[0] = byteSwapped(lengths[0]);
+	lengths[1] = byteSwapped(lengths[1]);
+	std::memcpy(image.data(), lengths, sizeof(lengths));
+	
+	// The object table is at the end of the image
+	int objectTableLength = (int) lengths[1];
+	std::uint16_t *objectTable = (std::uint16_t *) (image.data() + image.size() - objectTableLength * 2);
+	swapBytesOfWords(objectTable, objectTableLength);
+	
+	std::uint16_t *objectSpace = (std::uint16_t *) (image.data() + ObjectSpaceBaseInImage);
+	int objectSpaceLength = (int) ((image.size() - objectTableLength * 2 - ObjectSpaceBaseInImage) / 2); // in words
+	
+	for (int objectPointer = 2; objectPointer + 1 < objectTableLength; objectPointer += 2) {
+		// The bits of an entry, numbered from the most significant as in the Blue Book
+		std::uint16_t entry = objectTable[objectPointer];
+		if (entry & 0x0020) // free (bit 10)
+			continue;
+		int pointerBit = (entry & 0x0040) != 0; // bit 9
+		int location = ((entry & 0x000f) << 16) + objectTable[objectPointer + 1]; // segment is bits 12-15
+		if (location + HeaderSize > objectSpaceLength)
+			return false;
+		
+		std::uint16_t *object = objectSpace + location;
+		swapBytesOfWords(object, HeaderSize); // size and class
+		int size = object[0];
+		int classPointer = object[1];
+		if (size < HeaderSize || location + size > objectSpaceLength)
+			return false;
+		
+		std::uint16_t *fields = object + HeaderSize;
+		int fieldCount = size - HeaderSize;
+		if (classPointer == ClassCompiledMethod) {
+			if (fieldCount == 0)
+				return false;
+			swapBytesOfWords(fields, 1); // header
+			int literalCount = (fields[0] & 0x7e) >> 1;
+			swapBytesOfWords(fields + 1, std::min(literalCount, fieldCount - 1));
+		} else if (classPointer == ClassFloatPointer) {
+			if (fieldCount != 2)
+				return false;
+			std::uint16_t high = fields[0];
+			fields[0] = fields[1];
+			fields[1] = high;
+			swapBytesOfWords(fields, 2);
+		} else if (pointerBit || classPointer == ClassDisplayBitmapPointer || classPointer == ClassWordArrayPointer)
+			swapBytesOfWords(fields, fieldCount);
+	}
+	return true;
+}
+
+#endif
+
+bool ObjectMemory::loadObjectTable(const std::vector<char> &image) {
+	
+	// First two 32-bit values have the object space length and object table lengths in words
+	std::int32_t objectTableLength;
 	
-	if (fileSystem->read(fd, (char *) &objectTableLength, sizeof(objectTableLength)) != sizeof(objectTableLength))
+	if (image.size() < ObjectSpaceBaseInImage)
 		return false;
 	
-	int fileSize = fileSystem->file_size(fd);
+	std::memcpy(&objectTableLength, &image[4], sizeof(objectTableLength)); // Skip over object space length
 	
-	if (fileSystem->seek_to(fd, fileSize - objectTableLength * 2) == -1) // Reposition to start of object table
+	if (objectTableLength < 0 || objectTableLength > ObjectTableSize ||
+	    objectTableLength * 2 > (int) image.size() - ObjectSpaceBaseInImage)
 		return false;
 	
+	// The object table is at the end of the image
+	std::vector<std::uint16_t> words(objectTableLength);
+	std::memcpy(words.data(), image.data() + image.size() - objectTableLength * 2, objectTableLength * 2);
+	
 	for (int objectPointer = 0; objectPointer < objectTableLength; objectPointer += 2) {
-		std::uint16_t words[2];
-		if (fileSystem->read(fd, (char *) &words, sizeof(words)) != sizeof(words))
-			return false;
-		ot_put(objectPointer, words[0]);
-		locationBitsOf_put(objectPointer, words[1]);
+		ot_put(objectPointer, words[objectPointer]);
+		locationBitsOf_put(objectPointer, words[objectPointer + 1]);
 	}
 	
 	headOfFreePointerListPut(NonPointer);
@@ -97,12 +533,22 @@ bool ObjectMemory::loadObjectTable(IFileSystem *fileSystem, int fd) {
 	for (int objectPointer = ObjectTableSize - 2; objectPointer >= 2; objectPointer -= 2)
 		if (freeBitOf(objectPointer))
 			toFreePointerListAdd(objectPointer);
-	
+
+#ifdef OBJECT_TABLE_BITMAP
+	rebuildUsedEntries();
+#endif
 	freeOops = auditFreeOops();
 	return true;
 }
 
-bool ObjectMemory::loadObjects(IFileSystem *fileSystem, int fd) {
+// Where loadObjects puts an object, in words
+struct ObjectPlacement {
+	int location;     // in its heap segment
+	int imageAddress; // in the object space of the image
+	int size;
+};
+
+bool ObjectMemory::loadObjects(const std::vector<char> &image) {
 	static const int SegmentHeapSpaceSize = HeapSpaceStop + 1;
 	
 	// Track amount of free space available for objects in each segment
@@ -116,21 +562,35 @@ bool ObjectMemory::loadObjects(IFileSystem *fileSystem, int fd) {
 	
 	int destinationSegment = FirstHeapSegment, destinationWord = 0;
 	
-	for (int objectPointer = 2; objectPointer < ObjectTableSize; objectPointer += 2) {
-		if (freeBitOf(objectPointer))
-			continue;
-		
+	// The object space is everything between the first page and the object table
+	std::int32_t objectTableLength;
+	std::memcpy(&objectTableLength, &image[4], sizeof(objectTableLength));
+	
+	int objectSpaceBytes = (int) image.size() - objectTableLength * 2 - ObjectSpaceBaseInImage;
+	if (objectSpaceBytes < 0)
+		return false;
+	
+	const std::uint16_t *objectSpace = (const std::uint16_t *) (image.data() + ObjectSpaceBaseInImage);
+	int objectSpaceLength = objectSpaceBytes / (int) sizeof(std::uint16_t); // in words
+	
+	// Every object is placed first, and then the objects of each segment are copied
+	std::vector<ObjectPlacement> placements[HeapSegmentCount];
+	
+	for (int objectPointer = firstUsedEntryFrom(2); objectPointer < ObjectTableSize;
+	     objectPointer = firstUsedEntryFrom(objectPointer + 2)) {
 		// A free chunk has it's COUNT field set to zero but the free bit is clear
-		assert (countBitsOf(objectPointer) != 0); // SANITY Make sure a freeChunk wasn't saved!
+		if (countBitsOf(objectPointer) == 0)
+			return false; // SANITY Make sure a freeChunk wasn't saved!
 		
 		// On disk objects are stored contiguously as if a large 20-bit WORD addressed space
 		// In this scheme, the OT segment and locations combine to form a WORD address
 		const int objectImageWordAddress = (segmentBitsOf(objectPointer) << 16) + locationBitsOf(objectPointer);
+		if (objectImageWordAddress >= objectSpaceLength)
+			return false;
 		
-		fileSystem->seek_to(fd, ObjectSpaceBaseInImage + objectImageWordAddress * sizeof(std::uint16_t));
-		
-		std::uint16_t objectSize;
-		fileSystem->read(fd, (char *) &objectSize, sizeof(objectSize));
+		std::uint16_t objectSize = objectSpace[objectImageWordAddress];
+		if (objectSize < HeaderSize || objectImageWordAddress + objectSize > objectSpaceLength)
+			return false;
 		
 		// Account for the extra word used by HugeSize objects
 		int extraSpace = objectSize < HugeSize || pointerBitOf(objectPointer) == 0 ? 0 : 1;
@@ -147,29 +607,40 @@ bool ObjectMemory::loadObjects(IFileSystem *fileSystem, int fd) {
 		// Update OT entry so that it references the object location in ObjectMemory vs the disk image
 		segmentBitsOf_put(objectPointer, destinationSegment);
 		locationBitsOf_put(objectPointer, destinationWord);
-		
-		// Store the object in the image into word memory
-		// First comes the size...
-		sizeBitsOf_put(objectPointer, objectSize);
-		
-		// Next is the class...
-		std::uint16_t classBits;
-		fileSystem->read(fd, (char *) &classBits, sizeof(classBits));
-		
-		classBitsOf_put(objectPointer, classBits);
-		
-		// Followed by the fields...
-		for (int wordIndex = 0; wordIndex < objectSize - HeaderSize; wordIndex++) {
-			std::uint16_t word;
-			fileSystem->read(fd, (char *) &word, sizeof(word));
-			// use heap chunk
-			storeWord_ofObject_withValue(wordIndex, objectPointer, word);
-		}
+		placements[destinationSegment - FirstHeapSegment].push_back({destinationWord, objectImageWordAddress, objectSize});
 		
 		destinationWord += space;
 		heapSpaceRemaining[destinationSegment - FirstHeapSegment] -= space;
 	}
 	
+	// Store the objects in the image into word memory: the size, the class and the fields.
+	// Each segment is filled independently of the others, including clearing its free space.
+	auto fillSegment = [&](int segment) {
+		for (const ObjectPlacement &placement : placements[segment - FirstHeapSegment])
+			std::memcpy(&segment_word(segment, placement.location), &objectSpace[placement.imageAddress],
+			            placement.size * sizeof(std::uint16_t));
+#ifdef ZEROED_FREE_SPACE
+		int freeChunkSize = heapSpaceRemaining[segment - FirstHeapSegment];
+		if (freeChunkSize >= HeaderSize)
+			zeroFreeSpaceFrom(segment, SegmentHeapSpaceSize - freeChunkSize);
+#endif
+	};
+#ifdef PARALLEL_LOADING
+	int threadCount = std::min((int) HeapSegmentCount, std::max(1, (int) std::thread::hardware_concurrency()));
+	std::vector<std::thread> threads;
+	for (int worker = 0; worker < threadCount; worker++) {
+		threads.emplace_back([&fillSegment, threadCount](int first) {
+			for (int segment = first; segment <= LastHeapSegment; segment += threadCount)
+				fillSegment(segment);
+		}, FirstHeapSegment + worker);
+	}
+	for (auto &thread : threads)
+		thread.join();
+#else
+	for (int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++)
+		fillSegment(segment);
+#endif
+	
 	// Initialize the free chunk lists for each heap segment with the sentinel
 	for (int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++) {
 		for (int size = HeaderSize; size <= BigSize; size++)
@@ -195,6 +666,12 @@ bool ObjectMemory::loadObjects(IFileSystem *fileSystem, int fd) {
 		}
 	}
 	
+#ifdef SIZE_CLASS_REGIONS
+	forgetSizeClassRegions();
+#endif
+#ifdef INSTANCE_INDEX
+	forgetInstanceIndex();
+#endif
 	currentSegment = FirstHeapSegment;
 	return true;
 }
@@ -203,62 +680,347 @@ bool ObjectMemory::loadSnapshot(IFileSystem *fileSystem, const char *fileName) {
 	int fd = fileSystem->open_file(fileName);
 	if (fd == -1)
 		return false;
-	bool succeeded = loadObjectTable(fileSystem, fd) && loadObjects(fileSystem, fd);
+#ifdef NATIVE_IMAGES
+	char magic[8] = {0};
+	if (fileSystem->read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+	    std::memcmp(magic, NativeImageMagic, sizeof(magic)) == 0) {
+		bool succeeded = loadNativeImage(fileSystem, fd);
+		fileSystem->close_file(fd);
+#ifdef DELTA_SNAPSHOTS
+		if (succeeded)
+			succeeded = applyDeltaSnapshots(fileSystem, fileName);
+#endif
+		return succeeded;
+	}
+#endif
+	// The whole image is read at once, and unpacked if it was written compressed
+	std::vector<char> image;
+	int fileSize = fileSystem->file_size(fd);
+	bool succeeded = fileSize >= 0 && fileSystem->seek_to(fd, 0) != -1;
+	if (succeeded) {
+		image.resize(fileSize);
+		succeeded = fileSystem->read(fd, image.data(), fileSize) == fileSize;
+	}
 	fileSystem->close_file(fd);
-	return succeeded;
+#ifdef COMPRESSED_SNAPSHOTS
+	if (succeeded && fileSize >= (int) sizeof(PackedImageHeader) &&
+	    std::memcmp(image.data(), PackedImageMagic, std::strlen(PackedImageMagic)) == 0)
+		succeeded = unpackImage(image);
+#endif
+#ifdef BYTE_SWAPPED_IMAGES
+	// An image from a host of the other byte order is swapped as it is loaded. Any checksums
+	// it has were taken in that order, so they are not checked.
+	if (succeeded && imageIsByteSwapped(image))
+		return swapImageByteOrder(image) && loadObjectTable(image) && loadObjects(image);
+#endif
+#ifdef SNAPSHOT_CHECKSUMS
+	succeeded = succeeded && interchangeImageIsIntact(image);
+#endif
+	return succeeded && loadObjectTable(image) && loadObjects(image);
 }
 
+// Collects the bytes of a snapshot and writes them to the file in large blocks. When compressed,
+// each block is packed and written by a thread of its own while the next one is collected, or
+// straight away if threads is false. Nothing is allocated once reserve has been called.
+class SnapshotWriter {
+public:
+	SnapshotWriter(IFileSystem *fileSystem, int fd, SnapshotBuffers &buffers, bool compressed = false, bool threads = true) :
+			fileSystem(fileSystem), fd(fd), buffer(buffers.buffer)
+#ifdef SNAPSHOT_CHECKSUMS
+			, checksums(buffers.checksums)
+#endif
+#ifdef COMPRESSED_SNAPSHOTS
+			, block(buffers.block), packedBlock(buffers.packedBlock), recent(buffers.recent)
+#endif
+	{
+		reserve(buffers, compressed);
+		position = fileSystem->tell(fd);
+		buffer.clear();
+#ifdef SNAPSHOT_CHECKSUMS
+		checksums.clear();
+#endif
+#ifdef COMPRESSED_SNAPSHOTS
+		this->compressed = compressed;
+		this->threads = threads;
+		if (compressed)
+			position = 0; // the position in the image being packed
+#else
+		(void) compressed;
+		(void) threads;
+#endif
+	}
+	
+	// Allocate whatever writing a snapshot in buffers will need
+	static void reserve(SnapshotBuffers &buffers, bool compressed) {
+		buffers.buffer.reserve(BufferSize);
+#ifdef SNAPSHOT_CHECKSUMS
+		// No snapshot is as big as twice object memory
+		buffers.checksums.reserve(2 * sizeof(real_memory) / SnapshotChecksumChunk);
+#endif
+#ifdef COMPRESSED_SNAPSHOTS
+		if (compressed) {
+			buffers.block.reserve(BufferSize);
+			buffers.packedBlock.reserve(PackedBlockHeaderSize + packedBound(BufferSize));
+			buffers.recent.resize(1 << PackedHashBits);
+		}
+#else
+		(void) compressed;
+#endif
+	}
+	
+#ifdef COMPRESSED_SNAPSHOTS
+	~SnapshotWriter() {
+		finishPacking();
+	}
+#endif
+	
+	bool write(const void *bytes, int count) {
+		const char *data = (const char *) bytes;
+		position += count;
+		while (count > 0) {
+			int part = std::min(count, BufferSize - (int) buffer.size());
+			buffer.insert(buffer.end(), data, data + part);
+			data += part;
+			count -= part;
+			if ((int) buffer.size() == BufferSize && !writeBuffer())
+				return false;
+		}
+		return true;
+	}
+	
+	// Advance to the next page with zeros
+	bool padToPage(int pageSize = 512) {
+		static const char zeros[512] = {0};
+		int pad = ((position + pageSize - 1) / pageSize) * pageSize - position;
+		for (; pad > 0; pad -= (int) sizeof(zeros)) {
+			if (!write(zeros, std::min(pad, (int) sizeof(zeros))))
+				return false;
+		}
+		return true;
+	}
+	
+	bool flush() {
+#ifdef COMPRESSED_SNAPSHOTS
+		if (compressed)
+			return writeBuffer() && finishPacking();
+#endif
+		return writeBuffer();
+	}
+	
+#ifdef SNAPSHOT_CHECKSUMS
+	// Of every SnapshotChecksumChunk bytes written to the file so far, when not compressed
+	const std::vector<std::uint32_t> &chunkChecksums() {
+		return checksums;
+	}
+#endif
 
-bool ObjectMemory::padToPage(IFileSystem *fileSystem, int fd) {
-	int pos = fileSystem->tell(fd);
-	int desired = ((pos + 512 - 1) / 512) * 512;
-	std::uint16_t word = 0;
+private:
+	bool writeBuffer() {
+		if (buffer.empty())
+			return true;
+#ifdef COMPRESSED_SNAPSHOTS
+		if (compressed) {
+			if (!finishPacking())
+				return false;
+			block.swap(buffer);
+			buffer.clear();
+			if (threads)
+				packer = std::thread(&SnapshotWriter::packAndWriteBlock, this);
+			else
+				packAndWriteBlock();
+			return true;
+		}
+#endif
+		int count = (int) buffer.size();
+#ifdef SNAPSHOT_CHECKSUMS
+		// Only the last buffer is short, so chunks never straddle buffers
+		for (int offset = 0; offset < count; offset += SnapshotChecksumChunk)
+			checksums.push_back(snapshotChecksumOf(buffer.data() + offset, std::min(count - offset, SnapshotChecksumChunk)));
+#endif
+		bool written = fileSystem->write(fd, buffer.data(), count) == count;
+		buffer.clear();
+		return written;
+	}
 	
-	int pad = (desired - pos) / sizeof(word);
-	while (pad-- > 0)
-		if (fileSystem->write(fd, (char *) &word, sizeof(word)) != sizeof(word))
-			return false;
+#ifdef COMPRESSED_SNAPSHOTS
+	void packAndWriteBlock() {
+		if (!headerWritten) {
+			PackedImageHeader header = {};
+			std::memcpy(header.magic, PackedImageMagic, sizeof(header.magic));
+			header.version = PackedImageVersion;
+			header.blockSize = PackedImageBlockSize;
+			if (fileSystem->write(fd, (char *) &header, sizeof(header)) != sizeof(header)) {
+				packed = false;
+				return;
+			}
+			headerWritten = true;
+		}
+		
+		int length = (int) block.size();
+		packedBlock.resize(PackedBlockHeaderSize + packedBound(length));
+		int packedLength = packBlock((const std::uint8_t *) block.data(), length,
+		                             (std::uint8_t *) packedBlock.data() + PackedBlockHeaderSize, recent.data());
+		if (packedLength >= length) {
+			packedLength = length;
+			std::memcpy(packedBlock.data() + PackedBlockHeaderSize, block.data(), length);
+		}
+		
+		std::uint32_t blockHeader[3] = {(std::uint32_t) length, (std::uint32_t) packedLength, 0};
+#ifdef SNAPSHOT_CHECKSUMS
+		blockHeader[2] = snapshotChecksumOf(block.data(), length);
+#endif
+		std::memcpy(packedBlock.data(), blockHeader, PackedBlockHeaderSize);
+		int count = PackedBlockHeaderSize + packedLength;
+		packed = fileSystem->write(fd, packedBlock.data(), count) == count;
+	}
 	
-	return true;
-}
+	// Wait for the block being packed, answering whether it was written
+	bool finishPacking() {
+		if (!packer.joinable())
+			return packed;
+		packer.join();
+		return packed;
+	}
+#endif
+	
+	static const int BufferSize = 256 * 1024; // a whole number of SnapshotChecksumChunk
+	
+	IFileSystem *fileSystem;
+	int fd;
+	int position; // in the file, including what is still in the buffer
+	std::vector<char> &buffer;
+#ifdef SNAPSHOT_CHECKSUMS
+	std::vector<std::uint32_t> &checksums;
+#endif
+#ifdef COMPRESSED_SNAPSHOTS
+	bool compressed;
+	bool threads;
+	std::vector<char> &block;       // being packed by packer
+	std::vector<char> &packedBlock; // its sizes and packed bytes
+	std::vector<int> &recent;
+	std::thread packer;
+	bool packed = true;            // whether every block so far has been written
+	bool headerWritten = false;
+#endif
+};
 
 bool ObjectMemory::saveSnapshot(IFileSystem *fileSystem, const char *imageFileName) {
-	int fd = fileSystem->create_file(imageFileName);
-	if (fd == -1)
+#ifdef DELTA_SNAPSHOTS
+	if (savesDeltaSnapshot(imageFileName))
+		return saveDeltaSnapshot(fileSystem, imageFileName);
+#endif
+	return beginSnapshot(fileSystem, imageFileName) && endSnapshot(fileSystem, writeSnapshot(fileSystem));
+}
+
+bool ObjectMemory::beginSnapshot(IFileSystem *fileSystem, const char *imageFileName, bool threads) {
+	// The snapshot is written alongside the image, and only once it is safely on disk is it
+	// renamed over it, so that a snapshot which does not finish leaves the image as it was (and
+	// an image mapped into real_memory is never truncated under it)
+	snapshotImageName = imageFileName;
+	snapshotFileName = snapshotImageName + ".tmp";
+	snapshotFile = fileSystem->create_file(snapshotFileName.c_str());
+	if (snapshotFile == -1)
 		return false;
+	snapshotThreads = threads;
+
+#ifdef NATIVE_IMAGES
+	// Each native image is told apart from those it replaces, so stale deltas are not applied to it
+	snapshotImageId = std::random_device()() ^
+	                  (std::uint64_t) std::chrono::system_clock::now().time_since_epoch().count();
+	if (snapshotImageId == 0)
+		snapshotImageId = 1;
+#ifdef DELTA_SNAPSHOTS
+	snapshotNative = nativeSnapshots || deltaSnapshots; // deltas are only written against native images
+#else
+	snapshotNative = nativeSnapshots;
+#endif
+	if (snapshotNative) {
+		settleNativeImage();
+		gatherNativeImageTables(snapshotTables);
+	}
+#endif
+#ifdef COMPRESSED_SNAPSHOTS
+	SnapshotWriter::reserve(snapshotBuffers, compressedSnapshots);
+#else
+	SnapshotWriter::reserve(snapshotBuffers, false);
+#endif
+	return true;
+}
+
+bool ObjectMemory::writeSnapshot(IFileSystem *fileSystem) {
+#ifdef NATIVE_IMAGES
+	bool success = snapshotNative ? saveNativeImage(fileSystem, snapshotFile, snapshotImageId)
+	                              : saveObjects(fileSystem, snapshotFile);
+#else
+	bool success = saveObjects(fileSystem, snapshotFile);
+#endif
+	return success && fileSystem->file_flush(snapshotFile);
+}
+
+bool ObjectMemory::endSnapshot(IFileSystem *fileSystem, bool written) {
+	fileSystem->close_file(snapshotFile);
+	snapshotFile = -1;
 	
-	bool success = saveObjects(fileSystem, fd);
-	fileSystem->close_file(fd);
+	bool success = written && fileSystem->replace_file(snapshotFileName.c_str(), snapshotImageName.c_str());
+	if (!success)
+		fileSystem->delete_file(snapshotFileName.c_str());
+
+#ifdef NATIVE_IMAGES
+	if (success && snapshotNative)
+		imageId = snapshotImageId;
+#endif
+#ifdef DELTA_SNAPSHOTS
+	if (success && snapshotNative) {
+		// Deltas written against the image this one replaces no longer apply to anything. Their
+		// base is taken from real_memory now, so deltas are never written by a child process.
+		fileSystem->delete_file((snapshotImageName + DeltaFileSuffix).c_str());
+		deltaFileLength = 0;
+		deltaSequence = 0;
+		rememberDeltaBase(snapshotImageName.c_str());
+	}
+#endif
 	return success;
 }
 
 bool ObjectMemory::saveObjects(IFileSystem *fileSystem, int fd) {
 	// Avoid dumping out the entire object table -- we only need to write entries up until
 	// the last OT entry that references an object
-	int lastUsedObjectPointer = NonPointer;
-	for (int objectPointer = 2; objectPointer < ObjectTableSize; objectPointer += 2) {
+	int lastUsedObjectPointer = lastUsedEntryBefore(ObjectTableSize);
+	while (lastUsedObjectPointer != NonPointer && (lastUsedObjectPointer < 2 || !hasObject(lastUsedObjectPointer)))
+		lastUsedObjectPointer = lastUsedEntryBefore(lastUsedObjectPointer);
+	
+	int storedObjectTableLength = lastUsedObjectPointer + 2;
+	
+	// The lengths come first, so the objects are added up beforehand and the image can be
+	// written straight through (and packed as it goes)
+	std::int32_t lengths[2] = {0, storedObjectTableLength}; // object space, object table
+	for (int objectPointer = firstUsedEntryFrom(2); objectPointer < storedObjectTableLength;
+	     objectPointer = firstUsedEntryFrom(objectPointer + 2)) {
 		if (hasObject(objectPointer))
-			lastUsedObjectPointer = objectPointer;
+			lengths[0] += sizeBitsOf(objectPointer);
 	}
 	
-	int storedObjectTableLength = lastUsedObjectPointer + 2;
-	std::int32_t placeHolder[2] = {0};
+#ifdef COMPRESSED_SNAPSHOTS
+	SnapshotWriter writer(fileSystem, fd, snapshotBuffers, compressedSnapshots, snapshotThreads);
+#else
+	SnapshotWriter writer(fileSystem, fd, snapshotBuffers);
+#endif
 	
-	// Write place holder value for object space length and object table length
-	if (fileSystem->write(fd, (char *) &placeHolder, sizeof(placeHolder)) != sizeof(placeHolder))
+	// Write object space length and object table length
+	if (!writer.write(&lengths, sizeof(lengths)))
 		return false;
 	
 	// Write two zero bytes indicating interchange format
 	std::uint8_t interchange[2] = {0};
-	if (fileSystem->write(fd, (char *) &interchange, sizeof(interchange)) != sizeof(interchange))
+	if (!writer.write(&interchange, sizeof(interchange)))
 		return false;
 	
-	if (!padToPage(fileSystem, fd)) // Advance to next page before writing objects
+	if (!writer.padToPage()) // Advance to next page before writing objects
 		return false;
 	
 	// Write objects
-	std::int32_t objectSpaceLength = 0;
-	for (int objectPointer = 2; objectPointer < storedObjectTableLength; objectPointer += 2) {
+	for (int objectPointer = firstUsedEntryFrom(2); objectPointer < storedObjectTableLength;
+	     objectPointer = firstUsedEntryFrom(objectPointer + 2)) {
 		if (!hasObject(objectPointer))
 			continue;
 		
@@ -268,19 +1030,16 @@ bool ObjectMemory::saveObjects(IFileSystem *fileSystem, int fd) {
 		header[0] = objectSize;
 		header[1] = (std::uint16_t) fetchClassOf(objectPointer);
 		
-		if (fileSystem->write(fd, (char *) &header, sizeof(header)) != sizeof(header))
+		if (!writer.write(&header, sizeof(header)))
 			return false;
 		
+		// The fields follow the header in the chunk
 		int wordLengthOfObject = fetchWordLengthOf(objectPointer);
-		for (int wordIndex = 0; wordIndex < wordLengthOfObject; wordIndex++) {
-			std::uint16_t word = (std::uint16_t) fetchWord_ofObject(wordIndex, objectPointer);
-			if (fileSystem->write(fd, (char *) &word, sizeof(word)) != sizeof(word))
-				return false;
-		}
-		objectSpaceLength += objectSize;
+		if (!writer.write(&heapChunkOf_word(objectPointer, HeaderSize), wordLengthOfObject * sizeof(std::uint16_t)))
+			return false;
 	}
 	
-	if (!padToPage(fileSystem, fd)) // Advance to next page before writing object table
+	if (!writer.padToPage()) // Advance to next page before writing object table
 		return false;
 	
 	// Write object table
@@ -315,27 +1074,369 @@ bool ObjectMemory::saveObjects(IFileSystem *fileSystem, int fd) {
 			}
 		}
 		
-		// Assemble object table entry
-		std::uint16_t words[2];
-		words[0] = ot(objectPointer);
-		words[1] = locationBitsOf(objectPointer);
+		// Assemble object table entry
+		std::uint16_t words[2];
+		words[0] = ot(objectPointer);
+		words[1] = locationBitsOf(objectPointer);
+		
+		// Restore OT entry
+		ot_put(objectPointer, oldOTValue);
+		locationBitsOf_put(objectPointer, oldOTLocation);
+		
+		// Write this entry
+		if (!writer.write(&words, sizeof(words)))
+			return false;
+	}
+	
+	if (!writer.flush())
+		return false;
+	
+#ifdef SNAPSHOT_CHECKSUMS
+	// The checksum block goes in the first page, which was written with zeros where it goes
+	const std::vector<std::uint32_t> &checksums = writer.chunkChecksums();
+	if ((int) checksums.size() > SnapshotChecksumsLimit)
+		return false; // rather than leave the image unchecked
+	if (!checksums.empty()) {
+		SnapshotChecksums block = {};
+		std::memcpy(block.magic, SnapshotChecksumMagic, sizeof(block.magic));
+		block.chunkSize = SnapshotChecksumChunk;
+		block.chunkCount = (std::uint32_t) checksums.size();
+		std::copy(checksums.begin(), checksums.end(), block.checksums);
+		if (fileSystem->seek_to(fd, SnapshotChecksumsBase) == -1 ||
+		    fileSystem->write(fd, (char *) &block, sizeof(block)) != sizeof(block))
+			return false;
+	}
+#endif
+	return true;
+}
+
+#ifdef NATIVE_IMAGES
+
+bool ObjectMemory::loadNativeImage(IFileSystem *fileSystem, int fd) {
+	NativeImageHeader header;
+	
+	if (fileSystem->seek_to(fd, 0) == -1)
+		return false;
+	if (fileSystem->read(fd, (char *) &header, sizeof(header)) != sizeof(header))
+		return false;
+	if (header.version < 1 || header.version > NativeImageVersion || header.byteOrder != NativeImageByteOrder ||
+	    header.segmentCount != SegmentCount || header.segmentSize != SegmentSize)
+		return false;
+	
+	std::uint32_t features = header.version >= 2 ? header.features : 0;
+	int objectAddressesPosition = NativeImageHeaderSize + (int) sizeof(real_memory);
+	int usedEntriesPosition = objectAddressesPosition +
+	                          (features & NativeImageObjectAddresses ? NativeImageObjectAddressesSize : 0);
+	int zeroedSpacePosition = usedEntriesPosition + (features & NativeImageUsedEntries ? NativeImageUsedEntriesSize : 0);
+	int imageSize = zeroedSpacePosition + (features & NativeImageZeroedSpace ? NativeImageZeroedSpaceSize : 0);
+	if (fileSystem->file_size(fd) != imageSize)
+		return false;
+	
+	// Map object memory from the file if possible, so that each page is only read when it is
+	// first touched, and otherwise read all of it
+	imageMapped = fileSystem->map_file(fd, NativeImageHeaderSize, real_memory, sizeof(real_memory));
+	if (!imageMapped) {
+		if (fileSystem->seek_to(fd, NativeImageHeaderSize) == -1)
+			return false;
+		if (fileSystem->read(fd, (char *) real_memory, sizeof(real_memory)) != (int) sizeof(real_memory))
+			return false;
+	}
+	
+	// The tables that follow are read at once
+	std::vector<char> tables(imageSize - objectAddressesPosition);
+	if (!tables.empty() && (fileSystem->seek_to(fd, objectAddressesPosition) == -1 ||
+	                        fileSystem->read(fd, tables.data(), (int) tables.size()) != (int) tables.size()))
+		return false;
+	
+#ifdef SNAPSHOT_CHECKSUMS
+	if (features & NativeImageChecksums) {
+		if (snapshotChecksumOf(tables.data(), (int) tables.size()) != header.tablesChecksum)
+			return false;
+		
+		// Checking mapped memory would read every page of it now, which is what mapping avoids
+#ifndef CHECK_MAPPED_IMAGES
+		if (!imageMapped)
+#endif
+		{
+			std::vector<SnapshotChunk> chunks;
+			for (int index = 0; index < NativeImageChecksumCount; index++)
+				chunks.push_back({index * NativeImageChecksumChunk, NativeImageChecksumChunk, header.memoryChecksums[index]});
+			if (!snapshotChunksAreIntact((const char *) real_memory, chunks))
+				return false;
+		}
+	}
+#endif
+	
+	currentSegment = header.currentSegment;
+	freeWords = header.freeWords;
+	imageId = header.version >= 3 ? header.imageId : 0;
+	
+	// Read the tables kept beside object memory, or rebuild those the image was written without
+#ifdef OBJECT_ADDRESS_TABLE
+	if (!(features & NativeImageObjectAddresses) ||
+	    !loadNativeImageTable(tables, 0, objectAddresses, sizeof(objectAddresses))) {
+		for (int objectPointer = 0; objectPointer < ObjectTableSize; objectPointer += 2)
+			objectAddressOf_update(objectPointer);
+	}
+#endif
+#ifdef OBJECT_TABLE_BITMAP
+	if (!(features & NativeImageUsedEntries) ||
+	    !loadNativeImageTable(tables, usedEntriesPosition - objectAddressesPosition, usedEntries, sizeof(usedEntries)) ||
+	    !loadNativeImageTable(tables, usedEntriesPosition - objectAddressesPosition + sizeof(usedEntries),
+	                          &usedEntriesLimit, 4))
+		rebuildUsedEntries();
+#endif
+	freeOops = header.version >= 2 ? header.freeOops : auditFreeOops();
+#ifdef ZEROED_FREE_SPACE
+	if (!(features & NativeImageZeroedSpace) ||
+	    !loadNativeImageTable(tables, zeroedSpacePosition - objectAddressesPosition, zeroedSpaceStart,
+	                          sizeof(zeroedSpaceStart)) ||
+	    !loadNativeImageTable(tables, zeroedSpacePosition - objectAddressesPosition + sizeof(zeroedSpaceStart),
+	                          zeroedSpaceStop, sizeof(zeroedSpaceStop))) {
+		for (int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++)
+			zeroedSpaceStart[segment - FirstHeapSegment] = zeroedSpaceStop[segment - FirstHeapSegment] = 0;
+	}
+#endif
+#ifdef SIZE_CLASS_REGIONS
+	forgetSizeClassRegions();
+#endif
+#ifdef INSTANCE_INDEX
+	forgetInstanceIndex();
+#endif
+	return true;
+}
+
+bool ObjectMemory::loadNativeImageTable(const std::vector<char> &tables, int position, void *table, int bytes) {
+	if (position + bytes > (int) tables.size())
+		return false;
+	std::memcpy(table, tables.data() + position, bytes);
+	return true;
+}
+
+void ObjectMemory::settleNativeImage() {
+	// The image is loaded exactly as it is written, so nothing may be held in a region off
+	// the free chunk lists
+#ifdef SIZE_CLASS_REGIONS
+	for (int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++)
+		releaseSizeClassRegions(segment);
+#endif
+}
+
+void ObjectMemory::gatherNativeImageTables(std::vector<char> &tables) {
+	// The tables stored after real_memory, in the order loadNativeImage reads them
+	tables.clear();
+	auto addTable = [&tables](const void *table, int bytes) {
+		tables.insert(tables.end(), (const char *) table, (const char *) table + bytes);
+	};
+#ifdef OBJECT_ADDRESS_TABLE
+	addTable(objectAddresses, sizeof(objectAddresses));
+#endif
+#ifdef OBJECT_TABLE_BITMAP
+	std::int32_t limit = usedEntriesLimit;
+	addTable(usedEntries, sizeof(usedEntries));
+	addTable(&limit, sizeof(limit));
+#endif
+#ifdef ZEROED_FREE_SPACE
+	addTable(zeroedSpaceStart, sizeof(zeroedSpaceStart));
+	addTable(zeroedSpaceStop, sizeof(zeroedSpaceStop));
+#endif
+	(void) addTable;
+}
+
+bool ObjectMemory::saveNativeImage(IFileSystem *fileSystem, int fd, std::uint64_t id) {
+	// beginSnapshot has settled object memory and gathered the tables into snapshotTables
+	const std::vector<char> &tables = snapshotTables;
+	
+	NativeImageHeader header = {};
+	std::memcpy(header.magic, NativeImageMagic, sizeof(header.magic));
+	header.version = NativeImageVersion;
+	header.byteOrder = NativeImageByteOrder;
+	header.segmentCount = SegmentCount;
+	header.segmentSize = SegmentSize;
+	header.currentSegment = currentSegment;
+	header.freeWords = freeWords;
+	header.freeOops = freeOops;
+	header.imageId = id;
+#ifdef OBJECT_ADDRESS_TABLE
+	header.features |= NativeImageObjectAddresses;
+#endif
+#ifdef OBJECT_TABLE_BITMAP
+	header.features |= NativeImageUsedEntries;
+#endif
+#ifdef ZEROED_FREE_SPACE
+	header.features |= NativeImageZeroedSpace;
+#endif
+	
+#ifdef SNAPSHOT_CHECKSUMS
+	header.features |= NativeImageChecksums;
+	header.tablesChecksum = snapshotChecksumOf(tables.data(), (int) tables.size());
+	for (int index = 0; index < NativeImageChecksumCount; index++)
+		header.memoryChecksums[index] =
+				snapshotChecksumOf((const char *) real_memory + index * NativeImageChecksumChunk, NativeImageChecksumChunk);
+#endif
+	
+	SnapshotWriter writer(fileSystem, fd, snapshotBuffers);
+	return writer.write(&header, sizeof(header)) &&
+	       writer.padToPage(NativeImageHeaderSize) &&
+	       writer.write(real_memory, sizeof(real_memory)) &&
+	       writer.write(tables.data(), (int) tables.size()) &&
+	       writer.flush();
+}
+
+#endif
+
+#ifdef DELTA_SNAPSHOTS
+
+static std::uint32_t deltaChecksumOf(const void *bytes, int count, std::uint32_t checksum = 2166136261u) {
+	// FNV-1a, which may be carried on from one run of bytes to the next
+	const std::uint8_t *data = (const std::uint8_t *) bytes;
+	for (int index = 0; index < count; index++)
+		checksum = (checksum ^ data[index]) * 16777619u;
+	return checksum;
+}
+
+bool ObjectMemory::savesDeltaSnapshot(const char *imageFileName) {
+	// Once the deltas add up to half of object memory, a whole image is written instead
+	return deltaSnapshots && imageId != 0 && !deltaBase.empty() && deltaImageName == imageFileName &&
+	       deltaFileLength < (int) sizeof(real_memory) / 2;
+}
+
+void ObjectMemory::rememberDeltaBase(const char *imageFileName) {
+	deltaImageName = imageFileName;
+	if (deltaSnapshots)
+		deltaBase.assign(&real_memory[0][0], &real_memory[0][0] + SegmentCount * SegmentSize);
+	else
+		deltaBase.clear();
+}
+
+bool ObjectMemory::saveDeltaSnapshot(IFileSystem *fileSystem, const char *imageFileName) {
+	settleNativeImage();
+	
+	// Find the pages that have changed since the last snapshot
+	const std::uint16_t *memory = &real_memory[0][0];
+	std::vector<std::uint16_t> pages;
+	for (int page = 0; page < DeltaPageCount; page++) {
+		if (std::memcmp(memory + page * DeltaPageWords, &deltaBase[page * DeltaPageWords], DeltaPageBytes) != 0)
+			pages.push_back((std::uint16_t) page);
+	}
+	int pageCount = (int) pages.size();
+	
+	DeltaRecordHeader header = {};
+	std::memcpy(header.magic, DeltaMagic, sizeof(header.magic));
+	header.version = DeltaVersion;
+	header.sequence = deltaSequence;
+	header.imageId = imageId;
+	header.pageCount = pageCount;
+	header.currentSegment = currentSegment;
+	header.freeWords = freeWords;
+	header.freeOops = freeOops;
+	header.checksum = deltaChecksumOf(pages.data(), pageCount * 2);
+	for (int page : pages)
+		header.checksum = deltaChecksumOf(memory + page * DeltaPageWords, DeltaPageBytes, header.checksum);
+	
+	std::string deltaFileName = std::string(imageFileName) + DeltaFileSuffix;
+	int fd = deltaFileLength > 0 ? fileSystem->open_file(deltaFileName.c_str())
+	                             : fileSystem->create_file(deltaFileName.c_str());
+	if (fd == -1)
+		return false;
+	
+	// Anything beyond the last valid record was left by a snapshot that did not finish
+	bool success = fileSystem->truncate_to(fd, deltaFileLength) && fileSystem->seek_to(fd, deltaFileLength) != -1;
+	if (success) {
+		SnapshotWriter writer(fileSystem, fd, snapshotBuffers);
+		success = writer.write(&header, sizeof(header)) && writer.write(pages.data(), pageCount * 2);
+		for (int index = 0; success && index < pageCount; index++)
+			success = writer.write(memory + pages[index] * DeltaPageWords, DeltaPageBytes);
+		success = success && writer.flush() && fileSystem->file_flush(fd);
+	}
+	if (!success)
+		fileSystem->truncate_to(fd, deltaFileLength);
+	fileSystem->close_file(fd);
+	if (!success)
+		return false;
+	
+	deltaFileLength += (int) sizeof(header) + pageCount * (2 + DeltaPageBytes);
+	deltaSequence++;
+	for (int page : pages)
+		std::memcpy(&deltaBase[page * DeltaPageWords], memory + page * DeltaPageWords, DeltaPageBytes);
+	return true;
+}
+
+bool ObjectMemory::applyDeltaSnapshots(IFileSystem *fileSystem, const char *imageFileName) {
+	deltaFileLength = 0;
+	deltaSequence = 0;
+	
+	std::vector<char> deltas;
+	std::string deltaFileName = std::string(imageFileName) + DeltaFileSuffix;
+	int fd = imageId != 0 ? fileSystem->open_file(deltaFileName.c_str()) : -1;
+	if (fd != -1) {
+		int fileSize = fileSystem->file_size(fd);
+		if (fileSize > 0) {
+			deltas.resize(fileSize);
+			if (fileSystem->read(fd, deltas.data(), fileSize) != fileSize)
+				deltas.clear();
+		}
+		fileSystem->close_file(fd);
+	}
+	
+	// Apply records in turn up to the first that does not follow on from the one before,
+	// which may have been left by a snapshot that did not finish or by an earlier image
+	std::uint16_t *memory = &real_memory[0][0];
+	int position = 0;
+	DeltaRecordHeader header;
+	while ((int) deltas.size() - position >= (int) sizeof(header)) {
+		std::memcpy(&header, &deltas[position], sizeof(header));
+		if (std::memcmp(header.magic, DeltaMagic, sizeof(header.magic)) != 0 || header.version != DeltaVersion ||
+		    header.sequence != deltaSequence || header.imageId != imageId || header.pageCount > DeltaPageCount)
+			break;
+		
+		int pageCount = (int) header.pageCount;
+		int recordBytes = (int) sizeof(header) + pageCount * (2 + DeltaPageBytes);
+		if (recordBytes > (int) deltas.size() - position)
+			break;
 		
-		// Restore OT entry
-		ot_put(objectPointer, oldOTValue);
-		locationBitsOf_put(objectPointer, oldOTLocation);
+		const char *pageNumbers = &deltas[position + sizeof(header)];
+		const char *pages = pageNumbers + pageCount * 2;
+		std::uint32_t checksum = deltaChecksumOf(pageNumbers, pageCount * 2);
+		if (deltaChecksumOf(pages, pageCount * DeltaPageBytes, checksum) != header.checksum)
+			break;
 		
-		// Write this entry
-		if (fileSystem->write(fd, (char *) &words, sizeof(words)) != sizeof(words))
-			return false;
+		std::vector<std::uint16_t> numbers(pageCount);
+		std::memcpy(numbers.data(), pageNumbers, pageCount * 2);
+		if (std::any_of(numbers.begin(), numbers.end(), [](int page) { return page >= DeltaPageCount; }))
+			break;
+		for (int index = 0; index < pageCount; index++)
+			std::memcpy(memory + numbers[index] * DeltaPageWords, pages + index * DeltaPageBytes, DeltaPageBytes);
+		
+		currentSegment = header.currentSegment;
+		freeWords = header.freeWords;
+		freeOops = header.freeOops;
+		position += recordBytes;
+		deltaSequence++;
+	}
+	deltaFileLength = position;
+	
+	if (deltaSequence > 0) {
+		// The tables read with the image describe it as it was before the deltas
+#ifdef OBJECT_ADDRESS_TABLE
+		for (int objectPointer = 0; objectPointer < ObjectTableSize; objectPointer += 2)
+			objectAddressOf_update(objectPointer);
+#endif
+#ifdef OBJECT_TABLE_BITMAP
+		rebuildUsedEntries();
+#endif
+#ifdef ZEROED_FREE_SPACE
+		for (int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++)
+			zeroedSpaceStart[segment - FirstHeapSegment] = zeroedSpaceStop[segment - FirstHeapSegment] = 0;
+#endif
 	}
 	
-	// Now we can go back fill in the values for the image header.
-	fileSystem->seek_to(fd, 0);
-	fileSystem->write(fd, (char *) &objectSpaceLength, sizeof(objectSpaceLength));
-	fileSystem->write(fd, (char *) &storedObjectTableLength, sizeof(storedObjectTableLength));
+	rememberDeltaBase(imageFileName);
 	return true;
 }
 
+#endif
+
 int ObjectMemory::sweepCurrentSegmentFrom(int lowWaterMark) {
 	// sweepCurrentSegmentFrom:
 	
@@ -423,18 +1524,145 @@ void ObjectMemory::compactCurrentSegment() {
 	*/
 	
 	RUNTIME_CHECK(currentSegment >= FirstHeapSegment && currentSegment <= LastHeapSegment);
+#ifdef SIZE_CLASS_REGIONS
+	releaseSizeClassRegions(currentSegment);
+#endif
 	lowWaterMark = abandonFreeChunksInSegment(currentSegment);
 	if (lowWaterMark < HeapSpaceStop) {
 		reverseHeapPointersAbove(lowWaterMark);
 		bigSpace = sweepCurrentSegmentFrom(lowWaterMark);
 		deallocate(obtainPointer_location(HeapSpaceStop + 1 - bigSpace, bigSpace));
+#ifdef ZEROED_FREE_SPACE
+		zeroFreeSpaceFrom(currentSegment, bigSpace); // objects have moved through the zeroed space
+#endif
+	}
+}
+
+int ObjectMemory::fragmentedWords() {
+	// Free words in chunks that lie between objects rather than at the top of their segment.
+	// This is the space that compactHeap can gather together.
+	int words = 0;
+	int objectPointer;
+	int space;
+	
+	for (int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++) {
+		for (int size = HeaderSize; size <= BigSize; size++) {
+			objectPointer = headOfFreeChunkList_inSegment(size, segment);
+			while (objectPointer != NonPointer) {
+				space = sizeBitsOf(objectPointer);
+				if (locationBitsOf(objectPointer) + space < HeapSpaceStop)
+					words += space;
+				objectPointer = classBitsOf(objectPointer);
+			}
+		}
+	}
+	return words;
+}
+
+int ObjectMemory::compactHeap() {
+	// Compact every heap segment at once. This is compactCurrentSegment applied to the whole
+	// heap: the object table is the forwarding table, and the reversed pointers left in the
+	// heap lead from each object back to its entry. Objects slide down in address order into
+	// the lowest segment they fit in, so the free space ends up in one chunk at the top of
+	// each segment rather than scattered between objects. Answers the number of free words
+	// that were recovered from between objects.
+	
+	int reclaimed;
+	int top[HeapSegmentCount]; // the first word past the objects in each segment
+	int si;
+	int di;
+	int destination;
+	int objectPointer;
+	int size;
+	int space;
+	
+#ifdef SIZE_CLASS_REGIONS
+	for (int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++)
+		releaseSizeClassRegions(segment);
+#endif
+	reclaimed = fragmentedWords();
+	
+	for (int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++)
+		abandonFreeChunksInSegment(segment);
+	
+	// reverse the pointer of every object (reverseHeapPointersAbove: 0 for all segments in one pass)
+	for (objectPointer = firstUsedEntryFrom(0); objectPointer <= ObjectTableSize - 2;
+	     objectPointer = firstUsedEntryFrom(objectPointer + 2)) {
+		if (freeBitOf(objectPointer) == 0) {
+			size = sizeBitsOf(objectPointer); // rescue the size
+			sizeBitsOf_put(objectPointer, objectPointer); // reverse pointer
+			locationBitsOf_put(objectPointer, size); // save the size
+		}
+	}
+	
+	// sweep every segment in turn (sweepCurrentSegmentFrom: 0), with the destination allowed to
+	// move into a lower segment. The destination never passes the source since an object always
+	// fits at or below where it is now.
+	destination = FirstHeapSegment;
+	di = 0;
+	for (int source = FirstHeapSegment; source <= LastHeapSegment; source++) {
+		si = 0;
+		while (si < HeapSpaceStop) {
+			if (segment_word(source, si + 1) == NonPointer) {
+				// Unallocated, so skip it
+				si = si + segment_word(source, si);
+				continue;
+			}
+			objectPointer = segment_word(source, si); // reversed pointer!
+			size = locationBitsOf(objectPointer);     // the reversed size
+			space = (size < HugeSize || pointerBitOf(objectPointer) == 0) ? size : size + 1;
+			if (di + space > HeapSpaceStop + 1) {
+				// no room left in this segment, so start filling the next
+				top[destination - FirstHeapSegment] = di;
+				destination++;
+				di = 0;
+			}
+			segmentBitsOf_put(objectPointer, destination); // point object table at new location
+			locationBitsOf_put(objectPointer, di);
+			sizeBitsOf_put(objectPointer, size);  // restore the size to its proper place
+			// move the rest of the object (may overlap within a segment)
+			std::memmove(&segment_word(destination, di + 1), &segment_word(source, si + 1),
+			             (space - 1) * sizeof(std::uint16_t));
+			si += space;
+			di += space;
+		}
+	}
+	top[destination - FirstHeapSegment] = di;
+	for (int segment = destination + 1; segment <= LastHeapSegment; segment++)
+		top[segment - FirstHeapSegment] = 0;
+	
+	// what remains of each segment becomes a single free chunk
+	for (int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++) {
+		int bigSpace = top[segment - FirstHeapSegment];
+		if (HeapSpaceStop + 1 - bigSpace >= HeaderSize) {
+			currentSegment = segment;
+			deallocate(obtainPointer_location(HeapSpaceStop + 1 - bigSpace, bigSpace));
+		}
+#ifdef ZEROED_FREE_SPACE
+		// objects have moved through the zeroed space; a full segment is left with none
+		zeroFreeSpaceFrom(segment, std::min(bigSpace, HeapSpaceStop + 1 - HeaderSize));
+#endif
 	}
+	currentSegment = destination; // allocate from the last of the objects first
+	return reclaimed;
 }
 
-void ObjectMemory::garbageCollect() {
+void ObjectMemory::garbageCollect(GCReason reason) {
 	// Force a garbage collection
+#ifndef GC_STATISTICS
+	(void) reason; // only recorded in the statistics
+#endif
 #ifdef GC_MARK_SWEEP
+#ifdef GC_STATISTICS
+	int wordsBefore = freeWords;
+	int oopsBefore = freeOops;
+	auto start = std::chrono::steady_clock::now();
+#endif
 	reclaimInaccessibleObjects();
+#ifdef GC_STATISTICS
+	auto pause = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+	recordCollection(reason, pause.count(), wordsBefore, oopsBefore);
+#endif
 #endif
 }
 
@@ -444,6 +1672,9 @@ void ObjectMemory::releasePointer(int objectPointer) {
 	//	self freeBitOf: objectPointer put: 1.
 	//	self toFreePointerListAdd: objectPointer
 	freeBitOf_put(objectPointer, 1);
+#ifdef OBJECT_TABLE_BITMAP
+	usedEntryBitOf_put(objectPointer, 0);
+#endif
 	toFreePointerListAdd(objectPointer);
 }
 
@@ -471,7 +1702,8 @@ void ObjectMemory::reverseHeapPointersAbove(int lowWaterMark) {
 	*/
 	
 	/* pg. 673 G&R */
-	for (int objectPointer = 0; objectPointer <= ObjectTableSize - 2; objectPointer += 2) {
+	for (int objectPointer = firstUsedEntryFrom(0); objectPointer <= ObjectTableSize - 2;
+	     objectPointer = firstUsedEntryFrom(objectPointer + 2)) {
 		if (freeBitOf(objectPointer) == 0)  // the Object Table entry is in use
 		{
 			// the object is in this segment
@@ -540,9 +1772,20 @@ void ObjectMemory::reclaimInaccessibleObjects() {
 		self markAccessibleObjects.
 		self rectifyCountsAndDeallocateGarbage
 	*/
+#ifdef SIZE_CLASS_REGIONS
+	// Region chunks have a zero count, so the collection deallocates them with the garbage
+	forgetSizeClassRegions();
+#endif
+#ifdef INSTANCE_INDEX
+	forgetInstanceIndex(); // most of the garbage it refers to is about to be deallocated
+#endif
 	zeroReferenceCounts();
 	markAccessibleObjects();
 	rectifyCountsAndDeallocateGarbage();
+#if HEAP_COMPACTION_THRESHOLD > 0
+	if (freeWords > 0 && fragmentedWords() * 100 / freeWords >= HEAP_COMPACTION_THRESHOLD)
+		compactHeap();
+#endif
 }
 
 int ObjectMemory::markObjectsAccessibleFrom(int rootObjectPointer) {
@@ -558,6 +1801,19 @@ int ObjectMemory::markObjectsAccessibleFrom(int rootObjectPointer) {
 					self countBitsOf: objectPointer put: 1]
 	*/
 	
+#ifdef BITMAP_MARKING
+	// Roots are traced together once all of them are known
+	markRoots.push_back(rootObjectPointer);
+	return rootObjectPointer;
+#else
+#ifdef PARALLEL_MARKING
+	// Roots are traced together once all of them are known, unless there is just one thread
+	// to trace them with, when the sequential marker does better
+	if (markingThreadCount() > 1) {
+		markRoots.push_back(rootObjectPointer);
+		return rootObjectPointer;
+	}
+#endif
 	return forAllObjectsAccessibleFrom_suchThat_do(
 		rootObjectPointer,
 		[this](int objectPointer) { // the predicate tests for an unmarked object and marks it
@@ -569,6 +1825,7 @@ int ObjectMemory::markObjectsAccessibleFrom(int rootObjectPointer) {
 		[this](int objectPointer) { // the action restores the mark to count=1
 			countBitsOf_put(objectPointer, 1);
 		});
+#endif
 }
 
 void ObjectMemory::markAccessibleObjects() {
@@ -584,10 +1841,204 @@ void ObjectMemory::markAccessibleObjects() {
 	
 	if (gcNotification)
 		gcNotification->prepareForCollection();
+
+#ifdef PARALLEL_MARKING
+	markObjectsInParallel();
+#elif defined(BITMAP_MARKING)
+	markObjectsWithBitmap();
+#endif
+}
+
+#ifdef BITMAP_MARKING
+
+void ObjectMemory::markObjectsWithBitmap() {
+	// Trace everything accessible from markRoots using a mark bitmap and an explicit stack.
+	// Neither the count fields nor the fields of the objects are changed while marking.
+	
+	std::fill(std::begin(markBits), std::end(markBits), 0);
+	markStackTop = 0;
+	markStackOverflowed = false;
+	
+	// Free entries (e.g. oop 0) have nothing to trace
+	for (int rootObjectPointer : markRoots) {
+		if (isIntegerObject(rootObjectPointer) || freeBitOf(rootObjectPointer))
+			continue;
+		if (testAndSetMarkBitOf(rootObjectPointer)) {
+			if (markStackTop < MarkStackSize)
+				markStack[markStackTop++] = rootObjectPointer;
+			else
+				markStackOverflowed = true;
+		}
+		drainMarkStack();
+	}
+	markRoots.clear();
+	
+	while (markStackOverflowed) {
+		// Some objects were marked without being stacked, so their fields may not be marked.
+		// Marking the fields of every marked object again catches them.
+		markStackOverflowed = false;
+		for (int objectPointer = firstUsedEntryFrom(0); objectPointer <= ObjectTableSize - 2;
+		     objectPointer = firstUsedEntryFrom(objectPointer + 2)) {
+			if (markBitOf(objectPointer)) {
+				markFieldsOf(objectPointer);
+				drainMarkStack();
+			}
+		}
+	}
+	
+	// Leave marked objects with a count of one, just as the pointer reversal marker does, so
+	// rectifyCountsAndDeallocateGarbage can proceed as usual
+	for (int objectPointer = firstUsedEntryFrom(0); objectPointer <= ObjectTableSize - 2;
+	     objectPointer = firstUsedEntryFrom(objectPointer + 2)) {
+		if (markBitOf(objectPointer))
+			countBitsOf_put(objectPointer, 1);
+	}
+}
+
+void ObjectMemory::drainMarkStack() {
+	while (markStackTop > 0)
+		markFieldsOf(markStack[--markStackTop]);
+}
+
+void ObjectMemory::markFieldsOf(int objectPointer) {
+	// Mark the fields, starting at offset 1 which is the class, and stack the ones that
+	// were not already marked
+	int limit = lastPointerOf(objectPointer) - 1;
+	for (int offset = 1; offset <= limit; offset++) {
+		int next = heapChunkOf_word(objectPointer, offset);
+		if (!isIntegerObject(next) && testAndSetMarkBitOf(next)) {
+			if (markStackTop < MarkStackSize)
+				markStack[markStackTop++] = next;
+			else
+				markStackOverflowed = true;
+		}
+	}
+}
+
+#endif
+
+#ifdef PARALLEL_MARKING
+
+void ObjectMemory::markObjectsInParallel() {
+	// Trace everything accessible from markRoots using a mark bitmap instead of the count
+	// field, so that object memory is only read while the threads run. The interpreter is
+	// not running, so nothing else touches object memory until the threads are joined.
+	
+	int threadCount = markingThreadCount();
+	if (threadCount == 1)
+		return; // the roots have been marked already
+	
+	for (auto &word : markBits)
+		word.store(0, std::memory_order_relaxed);
+	
+	// Deal the roots out to the mark stacks. Free entries (e.g. oop 0) have nothing to trace.
+	std::vector<MarkStack> markStacks(threadCount);
+	int worker = 0;
+	for (int rootObjectPointer : markRoots) {
+		if (isIntegerObject(rootObjectPointer) || freeBitOf(rootObjectPointer))
+			continue;
+		if (testAndSetMarkBitOf(rootObjectPointer)) {
+			markStacks[worker].objectPointers.push_back(rootObjectPointer);
+			worker = (worker + 1) % threadCount;
+		}
+	}
+	markRoots.clear();
+	
+	activeMarkers = threadCount;
+	std::vector<std::thread> threads;
+	for (worker = 1; worker < threadCount; worker++)
+		threads.emplace_back(&ObjectMemory::markObjectsFromStack, this, worker, std::ref(markStacks));
+	markObjectsFromStack(0, markStacks);
+	for (auto &thread : threads)
+		thread.join();
+	
+	// Leave marked objects with a count of one, just as the sequential marker does, so
+	// rectifyCountsAndDeallocateGarbage can proceed as usual
+	for (int objectPointer = firstUsedEntryFrom(0); objectPointer <= ObjectTableSize - 2;
+	     objectPointer = firstUsedEntryFrom(objectPointer + 2)) {
+		if (markBitOf(objectPointer))
+			countBitsOf_put(objectPointer, 1);
+	}
+}
+
+void ObjectMemory::markObjectsFromStack(int worker, std::vector<MarkStack> &markStacks) {
+	MarkStack &markStack = markStacks[worker];
+	
+	// Objects taken from the stack, and those found unmarked while tracing them. Other
+	// threads cannot steal these, so the oldest are given back when there are plenty.
+	std::vector<int> batch;
+	
+	for (;;) {
+		if (batch.empty()) {
+			std::lock_guard<std::mutex> guard(markStack.lock);
+			std::size_t count = std::min(MarkBatchSize, markStack.objectPointers.size());
+			batch.assign(markStack.objectPointers.end() - count, markStack.objectPointers.end());
+			markStack.objectPointers.erase(markStack.objectPointers.end() - count, markStack.objectPointers.end());
+		}
+		
+		if (batch.empty()) {
+			if (stealMarkWork(worker, markStacks))
+				continue;
+			
+			// Out of work. A stack can only gain entries while its owner is active, so
+			// once no marker is active every stack is empty and marking is complete.
+			activeMarkers--;
+			for (;;) {
+				if (activeMarkers == 0)
+					return;
+				activeMarkers++;
+				if (stealMarkWork(worker, markStacks))
+					break;
+				activeMarkers--;
+				std::this_thread::yield();
+			}
+			continue;
+		}
+		
+		// Mark the fields, starting at offset 1 which is the class, and keep the ones that
+		// were not already marked
+		int objectPointer = batch.back();
+		batch.pop_back();
+		int limit = lastPointerOf(objectPointer) - 1;
+		for (int offset = 1; offset <= limit; offset++) {
+			int next = heapChunkOf_word(objectPointer, offset);
+			if (!isIntegerObject(next) && testAndSetMarkBitOf(next))
+				batch.push_back(next);
+		}
+		
+		if (batch.size() >= 2 * MarkBatchSize) {
+			std::lock_guard<std::mutex> guard(markStack.lock);
+			markStack.objectPointers.insert(markStack.objectPointers.end(), batch.begin(), batch.begin() + MarkBatchSize);
+			batch.erase(batch.begin(), batch.begin() + MarkBatchSize);
+		}
+	}
+}
+
+bool ObjectMemory::stealMarkWork(int worker, std::vector<MarkStack> &markStacks) {
+	// Move half of the first non-empty stack found onto this worker's stack
+	int threadCount = (int) markStacks.size();
+	for (int i = 1; i < threadCount; i++) {
+		MarkStack &victim = markStacks[(worker + i) % threadCount];
+		std::deque<int> stolen;
+		{
+			std::lock_guard<std::mutex> guard(victim.lock);
+			std::size_t count = (victim.objectPointers.size() + 1) / 2;
+			if (count == 0)
+				continue;
+			stolen.assign(victim.objectPointers.begin(), victim.objectPointers.begin() + count);
+			victim.objectPointers.erase(victim.objectPointers.begin(), victim.objectPointers.begin() + count);
+		}
+		std::lock_guard<std::mutex> guard(markStacks[worker].lock);
+		markStacks[worker].objectPointers.insert(markStacks[worker].objectPointers.end(), stolen.begin(), stolen.end());
+		return true;
+	}
+	return false;
 }
 
 #endif
 
+#endif
+
 void ObjectMemory::outOfMemoryError() {
 	assert(0);
 	hal->error("Out of memory");
@@ -609,10 +2060,15 @@ int ObjectMemory::allocateChunk(int size) {
 	objectPointer = attemptToAllocateChunk(size);
 #ifdef GC_MARK_SWEEP
 	if (objectPointer == NilPointer) {
-		reclaimInaccessibleObjects();
+		garbageCollect(GCAllocationFailure);
 		objectPointer = attemptToAllocateChunk(size);
 	}
 #endif
+	if (objectPointer == NilPointer && freeWords >= size) {
+		// There is room in total, but not in any one segment
+		compactHeap();
+		objectPointer = attemptToAllocateChunk(size);
+	}
 	
 	if (objectPointer != NilPointer) {
 		if (freeWords >= size)
@@ -669,7 +2125,9 @@ void ObjectMemory::rectifyCountsAndDeallocateGarbage() {
 	}
 	
 	// rectify counts, and deallocate garbage
-	for (int objectPointer = 0; objectPointer <= ObjectTableSize - 2; objectPointer += 2) {
+	int liveWords = 0; // space occupied by the survivors
+	for (int objectPointer = firstUsedEntryFrom(0); objectPointer <= ObjectTableSize - 2;
+	     objectPointer = firstUsedEntryFrom(objectPointer + 2)) {
 		
 		if (freeBitOf(objectPointer) != 0) // if is free entry, continue
 			continue;
@@ -677,11 +2135,11 @@ void ObjectMemory::rectifyCountsAndDeallocateGarbage() {
 		count = countBitsOf(objectPointer);
 		
 		if (count == 0) {// unmarked, so deallocate it
-			freeWords += spaceOccupiedBy(objectPointer); //dbanay
 			deallocate(objectPointer);
 		}
 		else {
 			// it is marked so rectify reference counts
+			liveWords += spaceOccupiedBy(objectPointer);
 			
 			if (count < 128)    // subtract 1 to compensate for the mark
 				countBitsOf_put(objectPointer, count - 1);
@@ -697,6 +2155,9 @@ void ObjectMemory::rectifyCountsAndDeallocateGarbage() {
 	
 	countBitsOf_put(NilPointer, 128);
 	freeOops = auditFreeOops();
+	// Chunks that were already free are deallocated again above, so count the free space
+	// as whatever the survivors leave over rather than adding up deallocated chunks
+	freeWords = HeapSegmentCount * (HeapSpaceStop + 1) - liveWords;
 	
 	if (gcNotification)
 		gcNotification->collectionCompleted();
@@ -709,7 +2170,9 @@ void ObjectMemory::zeroReferenceCounts() {
 				self countBitsOf: objectPointer put: 0]
 	*/
 	
-	for (int objectPointer = 0; objectPointer <= ObjectTableSize - 2; objectPointer += 2)
+	// Free entries are skipped: obtainPointer:location: clears the count of an entry it reuses
+	for (int objectPointer = firstUsedEntryFrom(0); objectPointer <= ObjectTableSize - 2;
+	     objectPointer = firstUsedEntryFrom(objectPointer + 2))
 		countBitsOf_put(objectPointer, 0);
 }
 
@@ -804,11 +2267,21 @@ int ObjectMemory::allocate_odd_pointer_extra_class(
 	classBitsOf_put(objectPointer, classPointer);
 	defaultValue = (pointerBit == 0) ? 0 : NilPointer;
 	
-	for (int i = HeaderSize; i <= size - 1; i++)
-		heapChunkOf_word_put(objectPointer, i, defaultValue);
+	// Fill the fields in one go rather than a word at a time; a chunk from zeroed space
+	// already holds the default value of an object without pointers
+#ifdef ZEROED_FREE_SPACE
+	if (!zeroedSpaceTakenBy(objectPointer, size + extraWord) || defaultValue != 0)
+#endif
+	std::fill_n(&heapChunkOf_word(objectPointer, HeaderSize), size - HeaderSize, (std::uint16_t) defaultValue);
 	
 	sizeBitsOf_put(objectPointer, size);
 	freeOops--; // dbanay
+#ifdef INSTANCE_INDEX
+	noteInstance_of(objectPointer, classPointer);
+#endif
+#ifdef ALLOCATION_PROFILING
+	profileAllocation(classPointer, size + extraWord);
+#endif
 	return objectPointer;
 }
 
@@ -956,7 +2429,7 @@ int ObjectMemory::countDown(int rootObjectPointer) {
 	RUNTIME_CHECK(countBitsOf(rootObjectPointer) > 0);
 	
 	// this is a pointer, so decrement its reference count
-	return forAllObjectsAccessibleFrom_suchThat_do(
+	int objectPointer = forAllObjectsAccessibleFrom_suchThat_do(
 		rootObjectPointer,
 		[this](int objectPointer) { // predicate
 			int count = countBitsOf(objectPointer) - 1;
@@ -971,8 +2444,18 @@ int ObjectMemory::countDown(int rootObjectPointer) {
 			freeWords += spaceOccupiedBy(objectPointer); //dbanay
 			freeOops++;
 			deallocate(objectPointer);
+#ifdef GC_STATISTICS
+			cascadeLength++;
+#endif
 		});
-	
+
+#ifdef GC_STATISTICS
+	if (cascadeLength > 0) {
+		recordCascade(cascadeLength);
+		cascadeLength = 0;
+	}
+#endif
+	return objectPointer;
 }
 
 int ObjectMemory::countUp(int objectPointer) {
@@ -1204,6 +2687,38 @@ int ObjectMemory::storeWord_ofObject_withValue(int wordIndex, int objectPointer,
 		objectPointer, HeaderSize + wordIndex, valueWord);
 }
 
+void ObjectMemory::copyBytes_from_ofObject_to_ofObject(int count, int sourceIndex, int sourcePointer,
+                                                       int destinationIndex, int destinationPointer) {
+	RUNTIME_CHECK(sourceIndex >= 0 && sourceIndex + count <= fetchByteLengthOf(sourcePointer));
+	RUNTIME_CHECK(destinationIndex >= 0 && destinationIndex + count <= fetchByteLengthOf(destinationPointer));
+	// The bytes of an object lie in order in memory, whatever the byte order of its words
+	std::memmove(&heapChunkOf_byte(destinationPointer, (HeaderSize * 2 + destinationIndex)),
+	             &heapChunkOf_byte(sourcePointer, (HeaderSize * 2 + sourceIndex)), count);
+}
+
+void ObjectMemory::copyWords_from_ofObject_to_ofObject(int count, int sourceIndex, int sourcePointer,
+                                                       int destinationIndex, int destinationPointer) {
+	RUNTIME_CHECK(sourceIndex >= 0 && sourceIndex + count <= fetchWordLengthOf(sourcePointer));
+	RUNTIME_CHECK(destinationIndex >= 0 && destinationIndex + count <= fetchWordLengthOf(destinationPointer));
+	std::memmove(&heapChunkOf_word(destinationPointer, (HeaderSize + destinationIndex)),
+	             &heapChunkOf_word(sourcePointer, (HeaderSize + sourceIndex)), count * sizeof(std::uint16_t));
+}
+
+void ObjectMemory::copyPointers_from_ofObject_to_ofObject(int count, int sourceIndex, int sourcePointer,
+                                                          int destinationIndex, int destinationPointer) {
+	// Each field is stored once, counting up the new value and down the old. Within one object
+	// the fields go backwards when moving up, so none is overwritten before it has been copied.
+	if (sourcePointer == destinationPointer && sourceIndex < destinationIndex) {
+		for (int index = count - 1; index >= 0; index--)
+			storePointer_ofObject_withValue(destinationIndex + index, destinationPointer,
+			                                fetchPointer_ofObject(sourceIndex + index, sourcePointer));
+	} else {
+		for (int index = 0; index < count; index++)
+			storePointer_ofObject_withValue(destinationIndex + index, destinationPointer,
+			                                fetchPointer_ofObject(sourceIndex + index, sourcePointer));
+	}
+}
+
 int ObjectMemory::initialInstanceOf(int classPointer) {
 	// Mario checks for the count bit not being zero. This is necessary
 	// because an OT entry with a clear free bit but a ZERO count marks
@@ -1218,7 +2733,10 @@ int ObjectMemory::initialInstanceOf(int classPointer) {
 		^NilPointer
 	*/
 	
-	for (int pointer = 0; pointer <= ObjectTableSize - 2; pointer += 2) {
+#ifdef INSTANCE_INDEX
+	return indexedInstanceOf_after(classPointer, -2);
+#else
+	for (int pointer = firstUsedEntryFrom(0); pointer <= ObjectTableSize - 2; pointer = firstUsedEntryFrom(pointer + 2)) {
 		// Only consider non-free entries that are not free chunks
 		if (freeBitOf(pointer) == 0 && countBitsOf(pointer) != 0) {
 			if (fetchClassOf(pointer) == classPointer)
@@ -1226,6 +2744,7 @@ int ObjectMemory::initialInstanceOf(int classPointer) {
 		}
 	}
 	return NilPointer;
+#endif
 }
 
 void ObjectMemory::swapPointersOf_and(int firstPointer, int secondPointer) {
@@ -1268,6 +2787,12 @@ void ObjectMemory::swapPointersOf_and(int firstPointer, int secondPointer) {
 	locationBitsOf_put(secondPointer, firstLocation);
 	pointerBitOf_put(secondPointer, firstPointerBit);
 	oddBitOf_put(secondPointer, firstOdd);
+
+#ifdef INSTANCE_INDEX
+	// Each has taken on the other's class
+	noteInstance_of(firstPointer, fetchClassOf(firstPointer));
+	noteInstance_of(secondPointer, fetchClassOf(secondPointer));
+#endif
 }
 
 int ObjectMemory::instantiateClass_withWords(int classPointer, int length) {
@@ -1304,15 +2829,28 @@ bool ObjectMemory::hasObject(int objectPointer) {
 }
 
 int ObjectMemory::auditFreeOops() {
-	int count = 0;
-	for (int objectPointer = 2; objectPointer < ObjectTableSize; objectPointer += 2) {
-		if (!hasObject(objectPointer))
-			count++;
+	// Count the entries that do hold objects; every other entry after the reserved oop 0 is free
+	int count = (ObjectTableSize - 2) / 2;
+	for (int objectPointer = firstUsedEntryFrom(2); objectPointer < ObjectTableSize;
+	     objectPointer = firstUsedEntryFrom(objectPointer + 2)) {
+		if (hasObject(objectPointer))
+			count--;
 	}
 	
 	return count;
 }
 
+#ifdef OBJECT_TABLE_BITMAP
+void ObjectMemory::rebuildUsedEntries() {
+	std::fill(std::begin(usedEntries), std::end(usedEntries), 0);
+	usedEntriesLimit = 0;
+	for (int objectPointer = 0; objectPointer <= ObjectTableSize - 2; objectPointer += 2) {
+		if (freeBitOf(objectPointer) == 0)
+			usedEntryBitOf_put(objectPointer, 1);
+	}
+}
+#endif
+
 int ObjectMemory::instantiateClass_withPointers(int classPointer, int length) {
 	int size;
 	int extra;
@@ -1346,15 +2884,19 @@ int ObjectMemory::instanceAfter(int objectPointer) {
 	*/
 	
 	classPointer = fetchClassOf(objectPointer);
-	
-	for (int pointer = objectPointer + 2; pointer <= ObjectTableSize - 2; pointer += 2) {
+
+#ifdef INSTANCE_INDEX
+	return indexedInstanceOf_after(classPointer, objectPointer);
+#else
+	for (int pointer = firstUsedEntryFrom(objectPointer + 2); pointer <= ObjectTableSize - 2;
+	     pointer = firstUsedEntryFrom(pointer + 2)) {
 		if (hasObject(pointer)) {
 			if (fetchClassOf(pointer) == classPointer)
 				return pointer;
 		}
 	}
 	return NilPointer;
-	
+#endif
 }
 
 int ObjectMemory::obtainPointer_location(int size, int location) {
@@ -1374,6 +2916,9 @@ int ObjectMemory::obtainPointer_location(int size, int location) {
 	if (objectPointer == NilPointer)
 		return NilPointer;
 	ot_put(objectPointer, 0);
+#ifdef OBJECT_TABLE_BITMAP
+	usedEntryBitOf_put(objectPointer, 1);
+#endif
 	segmentBitsOf_put(objectPointer, currentSegment);
 	locationBitsOf_put(objectPointer, location);
 	sizeBitsOf_put(objectPointer, size);
@@ -1473,6 +3018,14 @@ int ObjectMemory::attemptToAllocateChunkInCurrentSegment(int size) {
 	
 	if (objectPointer != NilPointer)
 		return objectPointer; // small chunk of exact size handy so use it
+
+#ifdef SIZE_CLASS_REGIONS
+	if (size < BigSize) {
+		objectPointer = allocateFromSizeClassRegion(size);
+		if (objectPointer != NilPointer)
+			return objectPointer;
+	}
+#endif
 	
 	predecessor = NonPointer; // remember predecessor of chunk under consideration
 	objectPointer = headOfFreeChunkList_inSegment(BigSize, currentSegment);
@@ -1515,3 +3068,271 @@ int ObjectMemory::attemptToAllocateChunkInCurrentSegment(int size) {
 	
 	return NilPointer; // the end of the linked list was reached and no fit was found
 }
+
+#ifdef ZEROED_FREE_SPACE
+
+void ObjectMemory::zeroFreeSpaceFrom(int segment, int location) {
+	// Clear the free chunk at location, the last in segment, leaving its header alone. It
+	// becomes the zeroed space of the segment, replacing whatever was known before.
+	int start = location + HeaderSize;
+	int stop = HeapSpaceStop + 1;
+	std::fill(&segment_word(segment, start), &segment_word(segment, stop), 0);
+	zeroedSpaceStart[segment - FirstHeapSegment] = start;
+	zeroedSpaceStop[segment - FirstHeapSegment] = stop;
+}
+
+bool ObjectMemory::zeroedSpaceTakenBy(int objectPointer, int space) {
+	// Answer whether the fields of the chunk just allocated for objectPointer are all in the
+	// zeroed space of its segment. Either way, the chunk is no longer zeroed space. Chunks are
+	// allocated from the top of the free chunk they are split from, so this usually just
+	// lowers the stop of the zeroed space.
+	int &start = zeroedSpaceStart[segmentBitsOf(objectPointer) - FirstHeapSegment];
+	int &stop = zeroedSpaceStop[segmentBitsOf(objectPointer) - FirstHeapSegment];
+	int chunkStart = locationBitsOf(objectPointer);
+	int chunkStop = chunkStart + space;
+	
+	if (chunkStop <= start || chunkStart >= stop)
+		return false;
+	
+	bool zeroed = chunkStart + HeaderSize >= start && chunkStop <= stop;
+	
+	// keep the larger of the zeroed space below the chunk and that above it
+	if (chunkStart - start >= stop - chunkStop)
+		stop = std::max(chunkStart, start);
+	else
+		start = chunkStop;
+	return zeroed;
+}
+
+#endif
+
+#ifdef SIZE_CLASS_REGIONS
+
+int ObjectMemory::allocateFromSizeClassRegion(int size) {
+	// Allocate from the region kept for chunks of this size in the current segment. A region
+	// is a free chunk carved from the big chunks that is on no free chunk list. Objects are
+	// taken from its top, so only its size changes, and objects of the same size allocated
+	// one after the other end up next to each other.
+	int &region = sizeClassRegions[currentSegment - FirstHeapSegment][size];
+	int regionSize;
+	int objectPointer;
+	
+	if (region == NonPointer) {
+		// A whole number of chunks, and at least BigSize so it comes from the big chunks
+		objectPointer = attemptToAllocateChunkInCurrentSegment((SizeClassRegionSize / size) * size);
+		if (objectPointer == NilPointer)
+			return NilPointer;
+		pointerBitOf_put(objectPointer, 0); // a reused chunk may still have it set
+		region = objectPointer;
+	}
+	
+	regionSize = sizeBitsOf(region);
+	if (regionSize == size) {
+		// last one, the region itself becomes the object
+		objectPointer = region;
+		region = NonPointer;
+		return objectPointer;
+	}
+	
+	objectPointer = obtainPointer_location(size, locationBitsOf(region) + regionSize - size);
+	if (objectPointer == NilPointer)
+		return NilPointer;
+	sizeBitsOf_put(region, regionSize - size);
+	return objectPointer;
+}
+
+void ObjectMemory::releaseSizeClassRegions(int segment) {
+	// Return what is left of the regions in segment to the free chunk lists
+	for (int size = HeaderSize; size < BigSize; size++) {
+		int &region = sizeClassRegions[segment - FirstHeapSegment][size];
+		if (region != NonPointer) {
+			deallocate(region);
+			region = NonPointer;
+		}
+	}
+}
+
+void ObjectMemory::forgetSizeClassRegions() {
+	for (int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++) {
+		for (int size = HeaderSize; size < BigSize; size++)
+			sizeClassRegions[segment - FirstHeapSegment][size] = NonPointer;
+	}
+}
+
+#endif
+
+#ifdef INSTANCE_INDEX
+
+int ObjectMemory::indexedInstanceOf_after(int classPointer, int objectPointer) {
+	// Answer the first instance of classPointer whose object pointer is greater than
+	// objectPointer, as the scans of the object table in initialInstanceOf and
+	// instanceAfter would, but looking only at what the index has for that class.
+	if (!instanceIndexBuilt)
+		buildInstanceIndex();
+	
+	auto found = instanceIndex.find(classPointer);
+	if (found == instanceIndex.end())
+		return NilPointer;
+	
+	InstanceList &list = found->second;
+	
+	// Merging the additions costs the length of the whole list, and looking through them costs
+	// their number, so they are only merged once there are more than the square root of the
+	// list's length. A loop that makes an instance for each one it enumerates stays cheap.
+	if (list.added.size() > 32 && list.added.size() * list.added.size() > list.instances.size()) {
+		std::vector<int> merged;
+		merged.reserve(list.instances.size() + list.added.size());
+		std::sort(list.added.begin(), list.added.end());
+		std::merge(list.instances.begin(), list.instances.end(),
+		           list.added.begin(), list.added.end(), std::back_inserter(merged));
+		// an entry can be reused for another instance of the same class
+		merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+		list.instances.swap(merged);
+		list.added.clear();
+	}
+	
+	int instance = NonPointer;
+	auto next = std::upper_bound(list.instances.begin(), list.instances.end(), objectPointer);
+	for (; next != list.instances.end(); ++next) {
+		if (hasObject(*next) && fetchClassOf(*next) == classPointer) {
+			instance = *next;
+			break;
+		}
+	}
+	
+	// An addition may come first
+	for (int added : list.added) {
+		if (added > objectPointer && added < instance && hasObject(added) && fetchClassOf(added) == classPointer)
+			instance = added;
+	}
+	return instance == NonPointer ? NilPointer : instance;
+}
+
+void ObjectMemory::buildInstanceIndex() {
+	// One pass over the object table leaves every list in object table order
+	instanceIndex.clear();
+	for (int pointer = firstUsedEntryFrom(0); pointer <= ObjectTableSize - 2; pointer = firstUsedEntryFrom(pointer + 2)) {
+		if (freeBitOf(pointer) == 0 && countBitsOf(pointer) != 0)
+			instanceIndex[fetchClassOf(pointer)].instances.push_back(pointer);
+	}
+	instanceIndexBuilt = true;
+	instanceIndexAdditions = 0;
+}
+
+void ObjectMemory::forgetInstanceIndex() {
+	instanceIndex.clear();
+	instanceIndexBuilt = false;
+	instanceIndexAdditions = 0;
+}
+
+#endif
+
+#ifdef ALLOCATION_PROFILING
+
+void ObjectMemory::profileAllocation(int classPointer, int size) {
+	AllocationCount &count = allocationCounts[classPointer];
+	count.objects++;
+	count.words += size;
+	
+	// Asking where the allocation came from is too slow to do every time
+	if (--allocationsUntilSample > 0 || !allocationSite)
+		return;
+	allocationsUntilSample = ALLOCATION_SAMPLE_INTERVAL;
+	
+	int method;
+	int instructionPointer;
+	int receiverClass;
+	allocationSite->currentAllocationSite(method, instructionPointer, receiverClass);
+	std::uint64_t key = ((std::uint64_t) method << 32) | ((std::uint64_t) (instructionPointer & 0xFFFF) << 16) |
+	                    (std::uint64_t) classPointer;
+	auto found = allocationSamples.find(key);
+	if (found == allocationSamples.end())
+		allocationSamples[key] = {method, instructionPointer, receiverClass, classPointer, 1};
+	else
+		found->second.samples++;
+}
+
+std::vector<ObjectMemory::SampledAllocationSite> ObjectMemory::sampledAllocationSites() const {
+	std::vector<SampledAllocationSite> sites;
+	sites.reserve(allocationSamples.size());
+	for (const auto &sample : allocationSamples)
+		sites.push_back(sample.second);
+	return sites;
+}
+
+void ObjectMemory::resetAllocationProfile() {
+	allocationCounts.clear();
+	allocationSamples.clear();
+	allocationsUntilSample = ALLOCATION_SAMPLE_INTERVAL;
+}
+
+#endif
+
+#ifdef GC_STATISTICS
+
+void ObjectMemory::recordCollection(GCReason reason, std::uint64_t microseconds, int wordsBefore, int oopsBefore) {
+	statistics.collections[reason]++;
+	
+	int bucket = 0;
+	while (bucket < GCPauseBuckets - 1 && microseconds >= (125u << bucket))
+		bucket++;
+	statistics.pauseHistogram[bucket]++;
+	statistics.totalPauseMicroseconds += microseconds;
+	statistics.maxPauseMicroseconds = std::max(statistics.maxPauseMicroseconds, microseconds);
+	statistics.lastPauseMicroseconds = microseconds;
+	
+	statistics.lastWordsReclaimed = std::max(0, freeWords - wordsBefore);
+	statistics.lastOopsReclaimed = std::max(0, freeOops - oopsBefore);
+	statistics.wordsReclaimed += statistics.lastWordsReclaimed;
+	statistics.oopsReclaimed += statistics.lastOopsReclaimed;
+	statistics.fragmentation = freeWords > 0 ? (int) ((std::int64_t) fragmentedWords() * 100 / freeWords) : 0;
+}
+
+void ObjectMemory::recordCascade(int length) {
+	int bucket = 0;
+	while (bucket < GCCascadeBuckets - 1 && length >= (2 << bucket))
+		bucket++;
+	statistics.cascadeHistogram[bucket]++;
+	statistics.cascades++;
+	statistics.maxCascade = std::max(statistics.maxCascade, length);
+}
+
+std::string ObjectMemory::gcStatisticsSummary() const {
+	char line[512];
+	std::uint64_t collections = 0;
+	for (int reason = 0; reason < GCReasonCount; reason++)
+		collections += statistics.collections[reason];
+	
+	int length = snprintf(line, sizeof(line),
+	                      "GC: %llu collections (allocation %llu, low space %llu, snapshot %llu, requested %llu, "
+	                      "headroom %llu), "
+	                      "pause last %.2f ms max %.2f ms total %.1f ms, reclaimed %llu words %llu oops, "
+	                      "fragmentation %d%%, ref count cascades %llu max %d, pauses",
+	                      (unsigned long long) collections,
+	                      (unsigned long long) statistics.collections[GCAllocationFailure],
+	                      (unsigned long long) statistics.collections[GCLowSpace],
+	                      (unsigned long long) statistics.collections[GCSnapshot],
+	                      (unsigned long long) statistics.collections[GCRequested],
+	                      (unsigned long long) statistics.collections[GCHeadroom],
+	                      statistics.lastPauseMicroseconds / 1000.0, statistics.maxPauseMicroseconds / 1000.0,
+	                      statistics.totalPauseMicroseconds / 1000.0,
+	                      (unsigned long long) statistics.wordsReclaimed, (unsigned long long) statistics.oopsReclaimed,
+	                      statistics.fragmentation, (unsigned long long) statistics.cascades, statistics.maxCascade);
+	std::string summary(line, std::min(length, (int) sizeof(line) - 1));
+	
+	// The histogram, as "<bound>:count" for each bucket in use
+	for (int bucket = 0; bucket < GCPauseBuckets; bucket++) {
+		if (statistics.pauseHistogram[bucket] == 0)
+			continue;
+		if (bucket < GCPauseBuckets - 1)
+			snprintf(line, sizeof(line), " <%gms:%llu", (125u << bucket) / 1000.0,
+			         (unsigned long long) statistics.pauseHistogram[bucket]);
+		else
+			snprintf(line, sizeof(line), " >=%gms:%llu", (125u << (bucket - 1)) / 1000.0,
+			         (unsigned long long) statistics.pauseHistogram[bucket]);
+		summary += line;
+	}
+	return summary;
+}
+
+#endif
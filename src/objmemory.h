@@ -30,11 +30,28 @@
 #include <cstdint>
 #include <cassert>
 #include <functional>
+#include <string>
+#include <vector>
 #include "hal.h"
 #include "filesystem.h"
 #include "realwordmemory.h"
 #include "oops.h"
 
+#if defined(OBJECT_TABLE_BITMAP) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(INSTANCE_INDEX) || defined(ALLOCATION_PROFILING)
+#include <unordered_map>
+#endif
+
+#ifdef PARALLEL_MARKING
+#include <atomic>
+
+// Work-stealing stack of objects waiting to be scanned by a marking thread (see objmemory.cpp)
+struct MarkStack;
+#endif
+
 // The Smalltalk-80 VM generates a tremendous amount of circular references as it runs
 //  -- primarily a MethodContext that references a BlockContext (from a temp field) that
 // has a back reference to that MethodContext (the sender field). If a reference counting only
@@ -95,6 +112,13 @@
 #define BigSize 20
 #define FirstFreeChunkListSize (BigSize + 1)
 
+// The number of objects the mark stack holds when BITMAP_MARKING is defined
+#define MarkStackSize 4096
+
+// The number of words carved from the big chunks at a time for each size below BigSize
+// when SIZE_CLASS_REGIONS is defined (rounded down to a whole number of chunks)
+#define SizeClassRegionSize 256
+
 // Heap Constants G&R pg. 658
 
 // The number of heaps segments used in the implementation.
@@ -159,6 +183,162 @@ public:
 	virtual void collectionCompleted() = 0;
 };
 
+#endif
+
+// Why a full garbage collection was started
+enum GCReason {
+	GCAllocationFailure, // no chunk big enough, or no object table entry, for an allocation
+	GCLowSpace,          // below the limits set by primitiveSignalAtOopsLeftWordsLeft
+	GCSnapshot,          // before saving a snapshot
+	GCRequested,         // asked for by the virtual machine or a primitive
+	GCHeadroom,          // between frames, once free space falls below the -headroom option
+	GCReasonCount
+};
+
+#ifdef NATIVE_IMAGES
+// A native image starts with this header, padded to NativeImageHeaderSize bytes, followed by
+// all of real_memory and then by the tables kept beside it that are named in the header's
+// features, in the order below. The header size is a whole number of pages so that real_memory
+// can be mapped from the file. Values are in the byte order of the machine that wrote the image.
+// Version 1 images have no tables, and they are rebuilt when loaded.
+#define NativeImageMagic "ST80NATV"
+#define NativeImageVersion 4
+#define NativeImageByteOrder 0x01020304
+#define NativeImageHeaderSize 16384
+
+#define NativeImageObjectAddresses 1 // objectAddresses
+#define NativeImageUsedEntries     2 // usedEntries followed by usedEntriesLimit
+#define NativeImageZeroedSpace     4 // zeroedSpaceStart followed by zeroedSpaceStop
+#define NativeImageChecksums       8 // the header's checksums are filled in (SNAPSHOT_CHECKSUMS)
+
+#define NativeImageObjectAddressesSize (ObjectTableSize / 2 * 4)
+#define NativeImageUsedEntriesSize     ((ObjectTableSize / 2 + 63) / 64 * 8 + 4)
+#define NativeImageZeroedSpaceSize     (HeapSegmentCount * 2 * 4)
+
+#define NativeImageChecksumChunk (64 * 1024)
+#define NativeImageChecksumCount (SegmentCount * SegmentSize * 2 / NativeImageChecksumChunk)
+
+struct NativeImageHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byteOrder;
+	std::uint32_t segmentCount;
+	std::uint32_t segmentSize;
+	std::int32_t currentSegment;
+	std::int32_t freeWords;
+	std::uint32_t features; // since version 2
+	std::int32_t freeOops;  // since version 2
+	std::uint64_t imageId;  // since version 3, chosen at random when written
+	std::uint32_t tablesChecksum; // since version 4, of everything after real_memory
+	std::uint32_t memoryChecksums[NativeImageChecksumCount]; // since version 4, of each chunk of real_memory
+};
+#endif
+
+#ifdef SNAPSHOT_CHECKSUMS
+// An interchange format image written here has this block at SnapshotChecksumsBase in its
+// first page, which is otherwise unused. It holds a checksum of every chunkSize bytes of the
+// file, taken with the block itself zeroed. Compressed images have a checksum in each block
+// instead, and native images have them in their header.
+#define SnapshotChecksumMagic "ST80SUMS"
+#define SnapshotChecksumChunk (64 * 1024)
+#define SnapshotChecksumsBase 16
+#define SnapshotChecksumsLimit ((ObjectSpaceBaseInImage - SnapshotChecksumsBase - 16) / 4)
+
+struct SnapshotChecksums {
+	char magic[8];
+	std::uint32_t chunkSize;
+	std::uint32_t chunkCount;
+	std::uint32_t checksums[SnapshotChecksumsLimit];
+};
+
+// The objects and object table of an interchange format image come from real_memory, and
+// each is preceded by at most a page, so every image written here fits the block
+static_assert((std::uint64_t) SnapshotChecksumsLimit * SnapshotChecksumChunk >=
+              (std::uint64_t) SegmentCount * SegmentSize * 2 + 2 * ObjectSpaceBaseInImage,
+              "SnapshotChecksums cannot cover the largest interchange format image");
+#endif
+
+#ifdef DELTA_SNAPSHOTS
+#ifndef NATIVE_IMAGES
+#error "DELTA_SNAPSHOTS requires NATIVE_IMAGES"
+#endif
+// Delta snapshots are records appended to a file named after the native image they apply to.
+// Each record is this header, the numbers of the pages of real_memory that changed since the
+// previous record (or the image) as 16-bit values, and then those pages. The checksum covers
+// the page numbers and pages.
+#define DeltaFileSuffix ".deltas"
+#define DeltaMagic "ST80DLTA"
+#define DeltaVersion 1
+#define DeltaPageWords 256
+#define DeltaPageBytes (DeltaPageWords * 2)
+#define DeltaPageCount (SegmentCount * SegmentSize / DeltaPageWords)
+
+struct DeltaRecordHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t sequence; // of the record in the file, from 0
+	std::uint64_t imageId;  // of the native image
+	std::uint32_t pageCount;
+	std::int32_t currentSegment;
+	std::int32_t freeWords;
+	std::int32_t freeOops;
+	std::uint32_t checksum;
+	std::uint32_t reserved;
+};
+#endif
+
+// What a snapshot is collected, checksummed and packed in before it is written. It is allocated
+// before the snapshot is written and kept from one snapshot to the next, so that writing one
+// allocates nothing (see ObjectMemory::beginSnapshot).
+struct SnapshotBuffers {
+	std::vector<char> buffer; // bytes waiting to be written
+#ifdef SNAPSHOT_CHECKSUMS
+	std::vector<std::uint32_t> checksums; // of each SnapshotChecksumChunk written
+#endif
+#ifdef COMPRESSED_SNAPSHOTS
+	std::vector<char> block;       // being packed
+	std::vector<char> packedBlock; // its sizes and packed bytes
+	std::vector<int> recent;       // where each hash of 4 bytes last was while packing
+#endif
+};
+
+#ifdef GC_STATISTICS
+// Collection pauses are counted in buckets that double from under 125 microseconds
+#define GCPauseBuckets 12
+
+// Reference count cascades (objects deallocated by one countDown) are counted in buckets of
+// 1, 2-3, 4-7 ... objects
+#define GCCascadeBuckets 16
+
+struct GCStatistics {
+	std::uint64_t collections[GCReasonCount];
+	std::uint64_t pauseHistogram[GCPauseBuckets];
+	std::uint64_t totalPauseMicroseconds;
+	std::uint64_t maxPauseMicroseconds;
+	std::uint64_t lastPauseMicroseconds;
+	std::uint64_t wordsReclaimed;
+	std::uint64_t oopsReclaimed;
+	int lastWordsReclaimed;
+	int lastOopsReclaimed;
+	int fragmentation; // percentage of the free words between objects after the last collection
+	std::uint64_t cascades;
+	std::uint64_t cascadeHistogram[GCCascadeBuckets];
+	int maxCascade;
+};
+#endif
+
+#ifdef ALLOCATION_PROFILING
+
+class IAllocationSite {
+public:
+	// Describe the code responsible for the allocation in progress
+	virtual void currentAllocationSite(int &method, int &instructionPointer, int &receiverClass) = 0;
+};
+
+#endif
+
+#ifdef GC_MARK_SWEEP
+
 class ObjectMemory {
 public:
 	ObjectMemory(IHardwareAbstractionLayer *halInterface, IGCNotification *notification = 0);
@@ -173,17 +353,78 @@ public:
 	
 	bool saveSnapshot(IFileSystem *fileSystem, const char *imageFileName);
 	
+	// saveSnapshot in three steps. beginSnapshot creates the file and allocates everything
+	// needed to write it. writeSnapshot writes it without allocating, and without starting
+	// threads unless threads is true, so that a child process made by fork() can run it.
+	// endSnapshot puts the file in place of the image if it was written, and answers whether
+	// it was.
+	bool beginSnapshot(IFileSystem *fileSystem, const char *imageFileName, bool threads = true);
+	
+	bool writeSnapshot(IFileSystem *fileSystem);
+	
+	bool endSnapshot(IFileSystem *fileSystem, bool written);
+
+#ifdef NATIVE_IMAGES
+	// Write snapshots as native images rather than in the interchange format
+	inline void setNativeSnapshots(bool native) {
+		nativeSnapshots = native;
+	}
+#endif
+
+#ifdef COMPRESSED_SNAPSHOTS
+	// Compress snapshots written in the interchange format
+	inline void setCompressedSnapshots(bool compressed) {
+		compressedSnapshots = compressed;
+	}
+#endif
+
+#ifdef DELTA_SNAPSHOTS
+	// Write snapshots of the native image that was loaded or last written as deltas against it
+	inline void setDeltaSnapshots(bool delta) {
+		deltaSnapshots = delta;
+	}
+	
+	inline bool writesDeltaSnapshots() {
+		return deltaSnapshots;
+	}
+#endif
+	
 	// --- BCIInterface ---
 
 	#define oopsLeft ObjectMemory::freeOops
 	#define coreLeft ((std::uint32_t)ObjectMemory::freeWords)
 	
-	void garbageCollect();
+	void garbageCollect(GCReason reason = GCRequested);
+
+#ifdef GC_STATISTICS
+	inline const GCStatistics &gcStatistics() const {
+		return statistics;
+	}
+	
+	// One line describing the collections so far
+	std::string gcStatisticsSummary() const;
+#endif
+	
+	// Compact all heap segments at once. Answers the number of free words recovered from
+	// between objects.
+	int compactHeap();
 	
 	int storePointer_ofObject_withValue(int fieldIndex, int objectPointer, int valuePointer);
 	
 	int storeWord_ofObject_withValue(int wordIndex, int objectPointer, int valueWord);
 	
+	// Copy count bytes, words or pointers of sourcePointer from sourceIndex over those of
+	// destinationPointer from destinationIndex, as memmove does: the two may be the same object
+	// with the ranges overlapping. Indices are zero relative, as for storeByte:ofObject:withValue:.
+	void copyBytes_from_ofObject_to_ofObject(int count, int sourceIndex, int sourcePointer,
+	                                         int destinationIndex, int destinationPointer);
+	
+	void copyWords_from_ofObject_to_ofObject(int count, int sourceIndex, int sourcePointer,
+	                                         int destinationIndex, int destinationPointer);
+	
+	void copyPointers_from_ofObject_to_ofObject(int count, int sourceIndex, int sourcePointer,
+	                                            int destinationIndex, int destinationPointer);
+	
 	inline void increaseReferencesTo(int objectPointer) {
 
 #ifdef GC_REF_COUNT
@@ -234,11 +475,26 @@ public:
 
 #define segmentBitsOf(objectPointer)  ot_bits_to(objectPointer, 12, 15)
 
+#ifdef OBJECT_ADDRESS_TABLE
+	// The chunk of an object is found through objectAddresses, which holds the address of each
+	// chunk as a word index into the whole of real_memory, (segment << 16) + location. This takes
+	// a single load rather than decoding both words of the object table entry.
+#define heapChunkAddressOf(objectPointer) objectAddresses[(objectPointer) >> 1]
+
+#define heap_word(address) (&real_memory[0][0])[address]
+
+#define heapChunkOf_byte(objectPointer, offset) \
+        ((std::uint8_t *) &heap_word(heapChunkAddressOf(objectPointer) + (offset) / 2))[(offset) % 2]
+
+#define heapChunkOf_word(objectPointer, offset) \
+        heap_word(heapChunkAddressOf(objectPointer) + (offset))
+#else
 #define heapChunkOf_byte(objectPointer, offset) \
         segment_word_byte(segmentBitsOf(objectPointer), locationBitsOf(objectPointer) + offset / 2, offset % 2)
 
 #define heapChunkOf_word(objectPointer, offset) \
         segment_word(segmentBitsOf(objectPointer), locationBitsOf(objectPointer) + offset)
+#endif
 	
 	// ^self heapChunkOf: objectPointer word: 0
 #define sizeBitsOf(objectPointer) \
@@ -328,8 +584,12 @@ public:
 		// ^wordMemory segment: (self segmentBitsOf: objectPointer)
 		//     word: ((self locationBitsOf: objectPointer) + (offset//2))
 		//     byte: (offset\\2) put: value
+#ifdef OBJECT_ADDRESS_TABLE
+		return heapChunkOf_byte(objectPointer, offset) = value;
+#else
 		return segment_word_byte_put(segmentBitsOf(objectPointer), locationBitsOf(objectPointer) + (offset / 2),
 		                             offset % 2, value);
+#endif
 	}
 	
 	inline int storeByte_ofObject_withValue(int byteIndex, int objectPointer, int valueByte) {
@@ -351,6 +611,36 @@ public:
 
 #endif
 
+#ifdef ALLOCATION_PROFILING
+	// --- AllocationProfiling ---
+	
+	struct AllocationCount {
+		std::uint64_t objects = 0;
+		std::uint64_t words = 0;
+	};
+	
+	struct SampledAllocationSite {
+		int method;
+		int instructionPointer;
+		int receiverClass;
+		int classPointer;  // of the objects allocated there
+		std::uint64_t samples;
+	};
+	
+	inline void setAllocationSite(IAllocationSite *site) {
+		allocationSite = site;
+	}
+	
+	// Objects and words allocated for each class since the profile was last reset
+	inline const std::unordered_map<int, AllocationCount> &allocationsByClass() const {
+		return allocationCounts;
+	}
+	
+	std::vector<SampledAllocationSite> sampledAllocationSites() const;
+	
+	void resetAllocationProfile();
+#endif
+
 private:
 	
 	// --- Compaction ---
@@ -365,6 +655,64 @@ private:
 	
 	int abandonFreeChunksInSegment(int segment);
 	
+	int fragmentedWords();
+
+#ifdef ZEROED_FREE_SPACE
+	// --- ZeroedFreeSpace ---
+	
+	void zeroFreeSpaceFrom(int segment, int location);
+	
+	bool zeroedSpaceTakenBy(int objectPointer, int space);
+	
+	// The words from start up to stop in each heap segment are known to be zero, apart from
+	// the header words of the chunks that lie within them
+	static int zeroedSpaceStart[HeapSegmentCount];
+	static int zeroedSpaceStop[HeapSegmentCount];
+#endif
+
+#ifdef SIZE_CLASS_REGIONS
+	// --- SizeClassRegions ---
+	
+	int allocateFromSizeClassRegion(int size);
+	
+	void releaseSizeClassRegions(int segment);
+	
+	void forgetSizeClassRegions();
+	
+	// The region chunk for each size below BigSize in each heap segment, or NonPointer
+	static int sizeClassRegions[HeapSegmentCount][BigSize];
+#endif
+
+#ifdef INSTANCE_INDEX
+	// --- InstanceIndex ---
+	
+	// The instances of one class in object table order. Entries are checked when they are
+	// used, so ones that have since been deallocated or become something else do no harm.
+	struct InstanceList {
+		std::vector<int> instances;  // sorted
+		std::vector<int> added;      // allocated since instances was sorted, in any order
+	};
+	
+	int indexedInstanceOf_after(int classPointer, int objectPointer);
+	
+	void buildInstanceIndex();
+	
+	void forgetInstanceIndex();
+	
+	inline void noteInstance_of(int objectPointer, int classPointer) {
+		if (instanceIndexBuilt) {
+			if (++instanceIndexAdditions > ObjectTableSize / 2)
+				forgetInstanceIndex(); // mostly stale by now, so start again when next needed
+			else
+				instanceIndex[classPointer].added.push_back(objectPointer);
+		}
+	}
+	
+	std::unordered_map<int, InstanceList> instanceIndex;
+	bool instanceIndexBuilt = false;
+	int instanceIndexAdditions = 0;
+#endif
+	
 	int allocateChunk(int size);
 
 #ifdef GC_MARK_SWEEP
@@ -380,6 +728,90 @@ private:
 	
 	void zeroReferenceCounts();
 
+#ifdef PARALLEL_MARKING
+	// --- ParallelMarking ---
+	
+	void markObjectsInParallel();
+	
+	void markObjectsFromStack(int worker, std::vector<MarkStack> &markStacks);
+	
+	bool stealMarkWork(int worker, std::vector<MarkStack> &markStacks);
+	
+	// Set the mark bit of objectPointer, answering true if it was previously clear
+	inline bool testAndSetMarkBitOf(int objectPointer) {
+		std::uint32_t bit = 1u << ((objectPointer >> 1) & 31);
+		return (markBits[objectPointer >> 6].fetch_or(bit) & bit) == 0;
+	}
+	
+	inline bool markBitOf(int objectPointer) {
+		return (markBits[objectPointer >> 6].load(std::memory_order_relaxed) >> ((objectPointer >> 1) & 31)) & 1;
+	}
+	
+	// One bit per object table entry, indexed by objectPointer/2
+	static std::atomic<std::uint32_t> markBits[(ObjectTableSize / 2 + 31) / 32];
+	
+	// Roots supplied during markAccessibleObjects, traced once all are known
+	std::vector<int> markRoots;
+	
+	// Number of marking threads that are not idle
+	std::atomic<int> activeMarkers;
+#endif
+
+#ifdef BITMAP_MARKING
+	// --- BitmapMarking ---
+	
+	void markObjectsWithBitmap();
+	
+	void markFieldsOf(int objectPointer);
+	
+	void drainMarkStack();
+	
+	// Set the mark bit of objectPointer, answering true if it was previously clear
+	inline bool testAndSetMarkBitOf(int objectPointer) {
+		std::uint32_t bit = 1u << ((objectPointer >> 1) & 31);
+		bool unmarked = (markBits[objectPointer >> 6] & bit) == 0;
+		markBits[objectPointer >> 6] |= bit;
+		return unmarked;
+	}
+	
+	inline bool markBitOf(int objectPointer) {
+		return (markBits[objectPointer >> 6] >> ((objectPointer >> 1) & 31)) & 1;
+	}
+	
+	// One bit per object table entry, indexed by objectPointer/2
+	static std::uint32_t markBits[(ObjectTableSize / 2 + 31) / 32];
+	
+	// Roots supplied during markAccessibleObjects, traced once all are known
+	std::vector<int> markRoots;
+	
+	// Marked objects whose fields are still to be marked. When it is full, objects are
+	// marked without being stacked and found again by a scan of the mark bitmap.
+	static int markStack[MarkStackSize];
+	static int markStackTop;
+	static bool markStackOverflowed;
+#endif
+
+#endif
+	
+#ifdef GC_STATISTICS
+	void recordCollection(GCReason reason, std::uint64_t microseconds, int wordsBefore, int oopsBefore);
+	
+	void recordCascade(int length);
+	
+	GCStatistics statistics = {};
+	int cascadeLength = 0; // objects deallocated by the countDown in progress
+#endif
+
+#ifdef ALLOCATION_PROFILING
+	void profileAllocation(int classPointer, int size);
+	
+	IAllocationSite *allocationSite = 0;
+	std::unordered_map<int, AllocationCount> allocationCounts;
+	
+	// Samples by method, instruction pointer and allocated class, packed as
+	// method << 32 | instructionPointer << 16 | classPointer
+	std::unordered_map<std::uint64_t, SampledAllocationSite> allocationSamples;
+	int allocationsUntilSample = ALLOCATION_SAMPLE_INTERVAL;
 #endif
 	
 	// --- NonpointerObjs ---
@@ -446,15 +878,36 @@ private:
 #define  pointerBitOf_put(objectPointer, value) ot_bits_to_put(objectPointer, 9, 9, value)
 	
 	// ^self ot: objectPointer bits: 12 to: 15 put: value
+#ifdef OBJECT_ADDRESS_TABLE
+	inline int segmentBitsOf_put(int objectPointer, int value) {
+		ot_bits_to_put(objectPointer, 12, 15, value);
+		objectAddressOf_update(objectPointer);
+		return value;
+	}
+#else
 #define  segmentBitsOf_put(objectPointer, value) ot_bits_to_put(objectPointer, 12, 15, value)
+#endif
 	
 	inline int heapChunkOf_word_put(int objectPointer, int offset, int value) {
 		// ^wordMemory segment: (self segmentBitsOf: objectPointer)
 		//     word: ((self locationBitsOf: objectPointer) + offset)
 		//     put: value
+#ifdef OBJECT_ADDRESS_TABLE
+		return heapChunkOf_word(objectPointer, offset) = value;
+#else
 		return segment_word_put(segmentBitsOf(objectPointer), locationBitsOf(objectPointer) + offset, value);
+#endif
+	}
+	
+#ifdef OBJECT_ADDRESS_TABLE
+	// Recompute the chunk address of objectPointer after its segment or location has changed
+	inline void objectAddressOf_update(int objectPointer) {
+		heapChunkAddressOf(objectPointer) = (segmentBitsOf(objectPointer) << 16) + locationBitsOf(objectPointer);
 	}
 	
+	static std::uint32_t objectAddresses[ObjectTableSize / 2];
+#endif
+	
 	// self cantBeIntegerObject: objectPointer.
 	// ^wordMemory segment: ObjectTableSegment
 	//     word: ObjectTableStart + objectPointer + 1
@@ -482,7 +935,13 @@ private:
 		//     word: ObjectTableStart + objectPointer + 1
 		//     put: value
 		cantBeIntegerObject(objectPointer);
+#ifdef OBJECT_ADDRESS_TABLE
+		segment_word_put(ObjectTableSegment, ObjectTableStart + objectPointer + 1, value);
+		objectAddressOf_update(objectPointer);
+		return value;
+#else
 		return segment_word_put(ObjectTableSegment, ObjectTableStart + objectPointer + 1, value);
+#endif
 	}
 	
 	// ^self ot: objectPointer bits: 8 to: 8 put: value
@@ -494,7 +953,13 @@ private:
 		//	 word: ObjectTableStart + objectPointer
 		//	 put: value
 		cantBeIntegerObject(objectPointer);
+#ifdef OBJECT_ADDRESS_TABLE
+		segment_word_put(ObjectTableSegment, ObjectTableStart + objectPointer, value);
+		objectAddressOf_update(objectPointer);
+		return value;
+#else
 		return segment_word_put(ObjectTableSegment, ObjectTableStart + objectPointer, value);
+#endif
 	}
 	
 	// ^self ot: objectPointer bits: 0 to: 7 put: value
@@ -510,6 +975,95 @@ private:
 	// ^self ot: objectPointer bits: 9 to: 9
 #define  pointerBitOf(objectPointer) ot_bits_to(objectPointer, 9, 9)
 	
+	// --- UsedEntries ---
+	
+	// The first object table entry at or after objectPointer whose free bit is clear (an
+	// object or a free chunk), or ObjectTableSize if there is none
+#ifdef OBJECT_TABLE_BITMAP
+	inline int firstUsedEntryFrom(int objectPointer) {
+		if (objectPointer >= usedEntriesLimit)
+			return ObjectTableSize;
+		int index = objectPointer >> 1;
+		int word = index >> 6;
+		std::uint64_t bits = usedEntries[word] & (~std::uint64_t(0) << (index & 63));
+		int lastWord = (usedEntriesLimit - 2) >> 7;
+		while (bits == 0) {
+			if (++word > lastWord)
+				return ObjectTableSize;
+			bits = usedEntries[word];
+		}
+		return ((word << 6) + lowestBitIndex(bits)) << 1;
+	}
+	
+	// The last entry before objectPointer whose free bit is clear, or NonPointer if there is none
+	inline int lastUsedEntryBefore(int objectPointer) {
+		int index = ((objectPointer < usedEntriesLimit ? objectPointer : usedEntriesLimit) >> 1) - 1;
+		if (index < 0)
+			return NonPointer;
+		int word = index >> 6;
+		std::uint64_t bits = usedEntries[word] & (~std::uint64_t(0) >> (63 - (index & 63)));
+		while (bits == 0) {
+			if (--word < 0)
+				return NonPointer;
+			bits = usedEntries[word];
+		}
+		return ((word << 6) + highestBitIndex(bits)) << 1;
+	}
+	
+	inline void usedEntryBitOf_put(int objectPointer, int value) {
+		std::uint64_t bit = std::uint64_t(1) << ((objectPointer >> 1) & 63);
+		if (value) {
+			usedEntries[objectPointer >> 7] |= bit;
+			if (objectPointer >= usedEntriesLimit)
+				usedEntriesLimit = objectPointer + 2;
+		}
+		else
+			usedEntries[objectPointer >> 7] &= ~bit;
+	}
+	
+	static inline int lowestBitIndex(std::uint64_t bits) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, bits);
+		return (int) index;
+#else
+		return __builtin_ctzll(bits);
+#endif
+	}
+	
+	static inline int highestBitIndex(std::uint64_t bits) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanReverse64(&index, bits);
+		return (int) index;
+#else
+		return 63 - __builtin_clzll(bits);
+#endif
+	}
+	
+	// Rebuild the bitmap and limit from the free bits of the whole object table
+	void rebuildUsedEntries();
+	
+	// One bit per object table entry whose free bit is clear, indexed by objectPointer/2
+	static std::uint64_t usedEntries[(ObjectTableSize / 2 + 63) / 64];
+	
+	// One past the highest entry whose free bit has been clear since the bitmap was rebuilt
+	static int usedEntriesLimit;
+#else
+	inline int firstUsedEntryFrom(int objectPointer) {
+		while (objectPointer < ObjectTableSize && freeBitOf(objectPointer))
+			objectPointer += 2;
+		return objectPointer;
+	}
+	
+	inline int lastUsedEntryBefore(int objectPointer) {
+		for (objectPointer -= 2; objectPointer >= 0; objectPointer -= 2)
+			if (!freeBitOf(objectPointer))
+				return objectPointer;
+		return NonPointer;
+	}
+#endif
+	
 	// --- Allocation ---
 	
 	int obtainPointer_location(int size, int location);
@@ -545,13 +1099,65 @@ private:
 	static int freeOops;  // free OT entries (make primitiveFreeOops "fast")
 	
 private:
-	bool loadObjectTable(IFileSystem *fileSystem, int fd);
+	bool loadObjectTable(const std::vector<char> &image);
 	
-	static bool padToPage(IFileSystem *fileSystem, int fd);
-	
-	bool loadObjects(IFileSystem *fileSystem, int fd);
+	bool loadObjects(const std::vector<char> &image);
 	
 	bool saveObjects(IFileSystem *fileSystem, int fd);
+	
+	// --- Snapshots ---
+	
+	// Prepared by beginSnapshot for writeSnapshot and endSnapshot
+	std::string snapshotImageName;
+	std::string snapshotFileName; // written, then renamed over the image
+	int snapshotFile = -1;
+	bool snapshotThreads = true;
+	SnapshotBuffers snapshotBuffers;
+
+#ifdef COMPRESSED_SNAPSHOTS
+	bool compressedSnapshots = false;
+#endif
+
+#ifdef NATIVE_IMAGES
+	bool loadNativeImage(IFileSystem *fileSystem, int fd);
+	
+	bool loadNativeImageTable(const std::vector<char> &tables, int position, void *table, int bytes);
+	
+	bool saveNativeImage(IFileSystem *fileSystem, int fd, std::uint64_t id);
+	
+	void settleNativeImage();
+	
+	void gatherNativeImageTables(std::vector<char> &tables);
+	
+	bool nativeSnapshots = false;
+	
+	// Of the native image being written by writeSnapshot
+	bool snapshotNative = false;
+	std::uint64_t snapshotImageId = 0;
+	std::vector<char> snapshotTables;
+	
+	// Whether real_memory is mapped from an image file, which must then not be rewritten in place
+	static bool imageMapped;
+	
+	// Of the native image loaded or last written, or 0
+	std::uint64_t imageId = 0;
+#endif
+
+#ifdef DELTA_SNAPSHOTS
+	bool savesDeltaSnapshot(const char *imageFileName);
+	
+	bool saveDeltaSnapshot(IFileSystem *fileSystem, const char *imageFileName);
+	
+	bool applyDeltaSnapshots(IFileSystem *fileSystem, const char *imageFileName);
+	
+	void rememberDeltaBase(const char *imageFileName);
+	
+	bool deltaSnapshots = false;
+	std::string deltaImageName;           // of the native image deltas are written against
+	std::vector<std::uint16_t> deltaBase; // real_memory as last written or loaded, to find changed pages
+	int deltaFileLength = 0;              // up to the end of the last valid record
+	std::uint32_t deltaSequence = 0;      // of the next record
+#endif
 
 #ifdef GC_MARK_SWEEP
 	IGCNotification *gcNotification;
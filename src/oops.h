@@ -56,6 +56,8 @@ static const int ClassCompiledMethod = 34;
 static const int ClassSymbolPointer = 56;
 
 static const int ClassFloatPointer = 20;
+static const int ClassDisplayBitmapPointer = 30;
+static const int ClassWordArrayPointer = 2674;
 
 static const int ClassSemaphorePointer = 38;
 static const int ClassDisplayScreenPointer = 834;
@@ -37,6 +37,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <sys/mman.h>
 
 #else
 #include <windows.h>
@@ -139,12 +140,20 @@ public:
 #ifndef _WIN32
 		return fsync(file_handle) != -1;
 #else
-		return true;
+		return _commit(file_handle) != -1;
 #endif
 	}
 
 #ifndef _WIN32
 	
+	bool map_file(int file_handle, int offset, void *address, int bytes) {
+		// A failed fixed mapping may leave nothing at address, so check alignment beforehand
+		long page_size = sysconf(_SC_PAGESIZE);
+		if (page_size <= 0 || (std::uintptr_t) address % page_size != 0 || offset % page_size != 0)
+			return false;
+		return mmap(address, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file_handle, offset) != MAP_FAILED;
+	}
+	
 	bool is_diretory(const char *name) {
 		std::string path = path_for_file(name);
 		struct stat statbuf;
@@ -202,6 +211,18 @@ public:
 		return rename(old_path.c_str(), new_path.c_str()) != -1;
 	}
 	
+	bool replace_file(const char *old_name, const char *new_name) {
+		std::string old_path = path_for_file(old_name);
+		std::string new_path = path_for_file(new_name);
+
+#ifdef _WIN32
+		// rename() will not replace an existing file here
+		return MoveFileExA(old_path.c_str(), new_path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+		return rename(old_path.c_str(), new_path.c_str()) != -1;
+#endif
+	}
+	
 	bool delete_file(const char *file_name) {
 		std::string path = path_for_file(file_name);
 
@@ -387,6 +387,15 @@ bool VirtualMachine::init() {
 	
 	texture_needs_update = false;
 	quit_signalled = false;
+#ifdef NATIVE_IMAGES
+	interpreter.setNativeSnapshots(vm_options.native_snapshots);
+#endif
+#ifdef COMPRESSED_SNAPSHOTS
+	interpreter.setCompressedSnapshots(vm_options.compressed_snapshots);
+#endif
+#ifdef DELTA_SNAPSHOTS
+	interpreter.setDeltaSnapshots(vm_options.delta_snapshots);
+#endif
 	return interpreter.init();
 }
 
@@ -659,6 +668,10 @@ void VirtualMachine::process_events() {
 }
 
 void VirtualMachine::run() {
+
+#ifdef GC_STATISTICS
+	Uint32 next_gc_log = SDL_GetTicks() + vm_options.gc_log_interval * 1000;
+#endif
 	
 	while (!quit_signalled) {
 		
@@ -668,10 +681,30 @@ void VirtualMachine::run() {
 		
 		for (int i = 0; i < vm_options.cycles_per_frame && !quit_signalled; i++)
 			interpreter.cycle();
+
+		if (vm_options.gc_headroom > 0)
+			interpreter.reclaimHeadroom(vm_options.gc_headroom);
+#ifdef FORK_SNAPSHOTS
+		interpreter.checkSnapshotCompletion();
+#endif
 		
 		render();
 		
 		if (!vm_options.vsync && vm_options.novsync_delay > 0)
 			SDL_Delay(vm_options.novsync_delay); // Don't kill CPU
+
+#ifdef GC_STATISTICS
+		if (vm_options.gc_log_interval > 0 && SDL_TICKS_PASSED(SDL_GetTicks(), next_gc_log)) {
+			std::cerr << interpreter.gcStatisticsSummary() << std::endl;
+			next_gc_log = SDL_GetTicks() + vm_options.gc_log_interval * 1000;
+		}
+#endif
 	}
+
+#ifdef ALLOCATION_PROFILING
+	interpreter.writeAllocationProfile("allocation.profile");
+#endif
+#ifdef FORK_SNAPSHOTS
+	interpreter.finishSnapshot(); // snapshotAs:thenQuit: must not lose the snapshot
+#endif
 }
\ No newline at end of file
@@ -41,6 +41,11 @@ struct options {
 	int display_scale;
 	bool vsync;
 	Uint32 novsync_delay;
+	Uint32 gc_log_interval; // seconds between garbage collection statistics lines, 0 for none
+	Uint32 gc_headroom;     // percentage of free space to keep by collecting between frames, 0 for none
+	bool native_snapshots;  // write snapshots as native images (NATIVE_IMAGES)
+	bool compressed_snapshots; // compress snapshots (COMPRESSED_SNAPSHOTS)
+	bool delta_snapshots;   // write snapshots as deltas against the native image (DELTA_SNAPSHOTS)
 };
 
 /*